@@ -0,0 +1,94 @@
+#include <algorithm>
+#include "block_cache.hpp"
+
+namespace {
+// The splitmix64 finalizer, used to spread the blocks over the shards and the buckets
+uint64_t mixBlock(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+}
+
+BlockCache::BlockCache(size_t capacity) : capacity(capacity) {
+    if (capacity == 0) {
+        return;
+    }
+    // A small cache has fewer shards, so that every shard still holds many pages
+    size_t numShards = std::clamp<size_t>(capacity / BLOCK_CACHE_MIN_SHARD_BYTES, 1, BLOCK_CACHE_NUM_SHARDS);
+    size_t shardCapacity = (capacity + numShards - 1) / numShards;
+    shards.reserve(numShards);
+    for (size_t i = 0; i < numShards; i++) {
+        shards.push_back(std::make_unique<Shard>(shardCapacity));
+    }
+}
+
+// Return an id no other file has had since the process started
+uint64_t BlockCache::newFileId() {
+    static std::atomic<uint64_t> nextFileId{0};
+    return nextFileId.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t BlockCache::EntryKeyHash::operator()(const EntryKey& key) const {
+    return mixBlock(key.fileId * 0x9e3779b97f4a7c15 ^ key.blockIndex);
+}
+
+BlockCache::Shard& BlockCache::getShard(const EntryKey& key) {
+    return *shards[EntryKeyHash{}(key) % shards.size()];
+}
+
+// Return the block, or nullptr if it is not cached and must be read from its file
+BlockCache::Block BlockCache::lookup(uint64_t fileId, uint64_t blockIndex, Kind kind) {
+    if (capacity == 0) {
+        return nullptr;
+    }
+    EntryKey key{fileId, blockIndex};
+    Shard& shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        misses[static_cast<size_t>(kind)].fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    hits[static_cast<size_t>(kind)].fetch_add(1, std::memory_order_relaxed);
+    return it->second->block;
+}
+
+// Cache a block read from its file, evicting the least recently used blocks of the shard until it fits. A block larger
+// than a whole shard is not cached. Readers that still hold an evicted block keep it alive until they are done.
+void BlockCache::insert(uint64_t fileId, uint64_t blockIndex, Block block) {
+    if (capacity == 0) {
+        return;
+    }
+    EntryKey key{fileId, blockIndex};
+    Shard& shard = getShard(key);
+    if (block->size() > shard.capacity) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Another reader may have read and cached the same block meanwhile
+    if (shard.entries.count(key) > 0) {
+        return;
+    }
+    while (shard.usage + block->size() > shard.capacity) {
+        const Entry &victim = shard.lru.back();
+        shard.usage -= victim.block->size();
+        shard.entries.erase({victim.fileId, victim.blockIndex});
+        shard.lru.pop_back();
+    }
+    shard.usage += block->size();
+    shard.lru.push_front({fileId, blockIndex, std::move(block)});
+    shard.entries[key] = shard.lru.begin();
+}
+
+// Return the bytes of all cached blocks
+size_t BlockCache::getUsage() {
+    size_t usage = 0;
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        usage += shard->usage;
+    }
+    return usage;
+}
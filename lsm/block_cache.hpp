@@ -0,0 +1,60 @@
+#pragma once
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include "data_types.hpp"
+
+// A sharded cache of the blocks read from the files of the runs, charged by their size in bytes. It holds both the
+// pages of the run files and the partitions of partitioned Bloom filters, so hot filter partitions and hot pages share
+// one memory budget and a partition nobody probes is evicted like any other block. Each shard is an LRU list behind its
+// own mutex. Every file read through the cache has its own id that is never reused, so the blocks of a deleted run are
+// never returned again and simply age out.
+class BlockCache {
+public:
+    using Block = std::shared_ptr<const std::vector<char>>;
+    enum class Kind { DATA, FILTER };
+
+    explicit BlockCache(size_t capacity);
+    static uint64_t newFileId();
+
+    Block lookup(uint64_t fileId, uint64_t blockIndex, Kind kind);
+    void insert(uint64_t fileId, uint64_t blockIndex, Block block);
+
+    size_t getCapacity() const { return capacity; }
+    size_t getUsage();
+    size_t getHits(Kind kind) const { return hits[static_cast<size_t>(kind)].load(std::memory_order_relaxed); }
+    size_t getMisses(Kind kind) const { return misses[static_cast<size_t>(kind)].load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        uint64_t fileId;
+        uint64_t blockIndex;
+        Block block;
+    };
+    struct EntryKey {
+        uint64_t fileId;
+        uint64_t blockIndex;
+        bool operator==(const EntryKey& other) const = default;
+    };
+    struct EntryKeyHash {
+        size_t operator()(const EntryKey& key) const;
+    };
+
+    struct Shard {
+        explicit Shard(size_t capacity) : capacity(capacity) {}
+        std::mutex mutex;
+        size_t capacity;
+        size_t usage = 0;       // Bytes of the blocks in the shard
+        std::list<Entry> lru;   // Most recently used first
+        std::unordered_map<EntryKey, std::list<Entry>::iterator, EntryKeyHash> entries;
+    };
+
+    size_t capacity;
+    std::vector<std::unique_ptr<Shard>> shards;
+    Shard& getShard(const EntryKey& key);
+    std::atomic<size_t> hits[2] = {0, 0};
+    std::atomic<size_t> misses[2] = {0, 0};
+};
@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <cmath>
+#include "block_hash_index.hpp"
+#include "utils.hpp"
+
+// The home buckets of a page's keys, followed by enough buckets that the probes of the last one stay in the page's index
+size_t BlockHashIndex::getNumBuckets(size_t pageEntries) {
+    return std::max<size_t>(1, std::ceil(pageEntries / BLOCK_HASH_INDEX_UTILIZATION)) + BLOCK_HASH_INDEX_PROBE_BUCKETS - 1;
+}
+
+// Multiplicative hashing, then mapping the 32-bit hash onto the home buckets with a multiply and shift instead of a
+// division
+size_t BlockHashIndex::getHomeBucket(KEY_t key, size_t pageEntries) {
+    uint32_t hash = static_cast<uint32_t>(key) * 0x9e3779b1u;
+    size_t homeBuckets = getNumBuckets(pageEntries) - BLOCK_HASH_INDEX_PROBE_BUCKETS + 1;
+    return (static_cast<uint64_t>(hash) * homeBuckets) >> 32;
+}
+
+// A second multiplicative hash mapped onto the tags from 1 up, since a bucket with tag 0 is empty
+uint16_t BlockHashIndex::getTag(KEY_t key) {
+    uint32_t hash = static_cast<uint32_t>(key) * 0x85ebca6bu;
+    constexpr uint64_t numTags = (1 << (16 - BLOCK_HASH_INDEX_SLOT_BITS)) - 1;
+    return 1 + ((static_cast<uint64_t>(hash) * numTags) >> 32);
+}
+
+// Build the buckets of a page holding count entries in key order
+std::vector<uint16_t> BlockHashIndex::build(const kvPair* entries, size_t count) {
+    if (count > (1 << BLOCK_HASH_INDEX_SLOT_BITS)) {
+        die("BlockHashIndex::build: Page of " + std::to_string(count) + " entries is too large for a block hash index");
+    }
+    std::vector<uint16_t> buckets(getNumBuckets(count), BLOCK_HASH_INDEX_EMPTY);
+    for (size_t slot = 0; slot < count; slot++) {
+        size_t home = getHomeBucket(entries[slot].key, count);
+        auto free = std::find(buckets.begin() + home, buckets.begin() + home + BLOCK_HASH_INDEX_PROBE_BUCKETS,
+                              BLOCK_HASH_INDEX_EMPTY);
+        // A key left out is found by searching the page
+        if (free != buckets.begin() + home + BLOCK_HASH_INDEX_PROBE_BUCKETS) {
+            *free = static_cast<uint16_t>(getTag(entries[slot].key) << BLOCK_HASH_INDEX_SLOT_BITS | slot);
+        }
+    }
+    return buckets;
+}
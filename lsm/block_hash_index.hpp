@@ -0,0 +1,20 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "data_types.hpp"
+
+// A hash table from key to slot for one page of a run, written after the run's data when the tree builds block hash
+// indexes. A key is stored in the first free bucket from its home bucket on, as its slot in the page tagged with a few
+// bits of a second hash of the key. A point lookup reads the BLOCK_HASH_INDEX_PROBE_BUCKETS buckets from the home
+// bucket of its key at once, and then only the entries whose tag matches, instead of binary searching the page. An
+// empty bucket before a match proves the key is not in the page. A key with no free bucket in reach is left out, so a
+// lookup that finds every bucket in reach taken without a match falls back to searching the page.
+class BlockHashIndex {
+public:
+    static size_t getNumBuckets(size_t pageEntries);
+    static size_t getHomeBucket(KEY_t key, size_t pageEntries);
+    static uint16_t getTag(KEY_t key);
+    static bool matches(uint16_t bucket, uint16_t tag) { return (bucket >> BLOCK_HASH_INDEX_SLOT_BITS) == tag; }
+    static uint16_t getSlot(uint16_t bucket) { return bucket & ((1 << BLOCK_HASH_INDEX_SLOT_BITS) - 1); }
+    static std::vector<uint16_t> build(const kvPair* entries, size_t count);
+};
@@ -1,69 +1,188 @@
 #include <iostream>
 #include <cmath>
 #include <sstream>
+#include <bit>
 #include "../lib/xxhash.h"
 #include "bloom_filter.hpp"
 #include "utils.hpp"
 
+// The error rate is reached with DEFAULT_BLOOM_FILTER_RESIDENT_UNITS enabled, so each unit gets that share of the bits.
+// The extra units are built as well so that hot runs can enable them later.
 BloomFilter::BloomFilter(size_t capacity, double errorRate) :
     capacity(capacity), errorRate(errorRate),
-    numBits(std::ceil(-(capacity * std::log(errorRate)) / std::log(2) / std::log(2))),
-    numHashes(std::ceil(std::log(2) * (numBits / capacity))),
-    bits(numBits) {}
+    numUnits(DEFAULT_BLOOM_FILTER_UNITS), enabledUnits(DEFAULT_BLOOM_FILTER_RESIDENT_UNITS)
+{
+    size_t totalBits = std::ceil(-(capacity * std::log(errorRate)) / std::log(2) / std::log(2));
+    unitBits = std::ceil(static_cast<double>(totalBits) / enabledUnits);
+    numBits = unitBits * enabledUnits;
+    setNumHashes();
+    units.assign(numUnits, std::vector<uint64_t>(getUnitWords(), 0));
+}
+
+void BloomFilter::setNumHashes() {
+    numHashes = (capacity == 0 || unitBits == 0) ? 1 : std::max(1, static_cast<int>(std::ceil(std::log(2) * unitBits / capacity)));
+}
+
+// Map a key to the 32-bit fingerprint all filter hashes are derived from. The mapping is the MurmurHash3 finalizer,
+// which is a bijection on 32-bit integers, so runs can store fingerprints instead of keys without adding collisions.
+uint32_t BloomFilter::fingerprint(const KEY_t key) {
+    uint32_t h = static_cast<uint32_t>(key);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
 
 void BloomFilter::add(const KEY_t key) {
-    XXH128_hash_t hash = XXH3_128bits(static_cast<const void*>(&key), sizeof(KEY_t));
+    addFingerprint(fingerprint(key));
+}
+
+// Add a key's fingerprint to every resident unit. Units are built all at once, so this is called while all of them are resident.
+void BloomFilter::addFingerprint(const uint32_t fingerprint) {
+    if (unitBits == 0) {
+        return;
+    }
+    XXH128_hash_t hash = XXH3_128bits(static_cast<const void*>(&fingerprint), sizeof(uint32_t));
     uint64_t hash1 = hash.high64;
     uint64_t hash2 = hash.low64;
 
-    for (int i = 0; i < numHashes; i++) {
-        size_t index = (hash1 + i * hash2) % numBits;
-        bits.set(index);
+    for (size_t u = 0; u < numUnits; u++) {
+        if (units[u].empty()) {
+            continue;
+        }
+        for (int i = 0; i < numHashes; i++) {
+            size_t index = (hash1 + (u * numHashes + i) * hash2) % unitBits;
+            units[u][index / 64] |= uint64_t(1) << (index % 64);
+        }
     }
 }
 
-bool BloomFilter::contains(const KEY_t key) {
-    XXH128_hash_t hash = XXH3_128bits(static_cast<const void*>(&key), sizeof(KEY_t));
-    uint64_t hash1 = hash.high64;
-    uint64_t hash2 = hash.low64;
+bool BloomFilter::contains(const KEY_t key) const {
+    return containsHash(hashKey(key));
+}
+
+// Return the two hashes all probes of a key are derived from
+KeyHash BloomFilter::hashKey(const KEY_t key) {
+    return hashFingerprint(fingerprint(key));
+}
 
-    for (int i = 0; i < numHashes; i++) {
-        size_t index = (hash1 + i * hash2) % numBits;
-        if (!bits.test(index)) {
-            return false;
+KeyHash BloomFilter::hashFingerprint(const uint32_t fingerprint) {
+    XXH128_hash_t hash = XXH3_128bits(static_cast<const void*>(&fingerprint), sizeof(uint32_t));
+    return {hash.high64, hash.low64};
+}
+
+// Return the word holding the bit of the given probe and set mask to that bit. The probes are numbered across the
+// enabled units in the order contains() tests them, so a key is present if the bits of all getNumProbes() probes are set.
+const uint64_t* BloomFilter::getProbeWord(uint64_t hash1, uint64_t hash2, size_t probe, uint64_t& mask) const {
+    size_t index = (hash1 + probe * hash2) % unitBits;
+    mask = uint64_t(1) << (index % 64);
+    return &units[probe / numHashes][index / 64];
+}
+
+bool BloomFilter::containsHash(const KeyHash& hash) const {
+    // A filter with no bits cannot rule anything out
+    if (unitBits == 0 || enabledUnits == 0) {
+        return true;
+    }
+    auto [hash1, hash2] = hash;
+    for (size_t u = 0; u < enabledUnits; u++) {
+        for (int i = 0; i < numHashes; i++) {
+            size_t index = (hash1 + (u * numHashes + i) * hash2) % unitBits;
+            if (!(units[u][index / 64] & (uint64_t(1) << (index % 64)))) {
+                return false;
+            }
         }
     }
     return true;
 }
 
-// Resize bloom filter to new bitset size
+size_t BloomFilter::getNumSetBits() const {
+    size_t count = 0;
+    for (size_t u = 0; u < enabledUnits; u++) {
+        for (const auto &word : units[u]) {
+            count += std::popcount(word);
+        }
+    }
+    return count;
+}
+
+// Resize bloom filter to new bitset size. The bits are spread over the enabled units and every unit is cleared and
+// made resident, so the filter must be repopulated and its units written out again afterwards.
 void BloomFilter::resize(size_t newNumBits) {
-    numBits = newNumBits;
-    bits.resize(newNumBits);
-    numHashes = std::ceil(std::log(2) * (newNumBits / capacity));
+    size_t divisor = std::max<size_t>(enabledUnits, 1);
+    unitBits = newNumBits / divisor;
+    numBits = unitBits * divisor;
+    setNumHashes();
+    units.assign(numUnits, std::vector<uint64_t>(getUnitWords(), 0));
+}
+
+// The false positive rate of a single unit
+double BloomFilter::unitErrorRate() const {
+    if (unitBits == 0) {
+        return 1.0;
+    }
+    return std::pow(1 - std::exp(-static_cast<double>(numHashes * capacity) / static_cast<double>(unitBits)), numHashes);
 }
 
 double BloomFilter::theoreticalErrorRate() const {
-    return std::pow(1 - std::exp(-static_cast<double>(numHashes * capacity) / static_cast<double>(numBits)), numHashes);
+    return std::pow(unitErrorRate(), enabledUnits);
+}
+
+// Write every unit to the filter file, one after the other. All units must be resident.
+void BloomFilter::writeUnits(std::ofstream& ofs) const {
+    for (const auto &unit : units) {
+        if (unit.empty() && unitBits > 0) {
+            die("BloomFilter::writeUnits: Attempting to write a unit that is not resident");
+        }
+        ofs.write(reinterpret_cast<const char*>(unit.data()), sizeof(uint64_t) * unit.size());
+    }
 }
-  
 
+// Enable the first newEnabledUnits units, loading any missing ones from the filter file and freeing the rest
+void BloomFilter::setEnabledUnits(size_t newEnabledUnits, std::ifstream& ifs) {
+    newEnabledUnits = std::min(newEnabledUnits, numUnits);
+    size_t unitWords = getUnitWords();
+    for (size_t u = 0; u < newEnabledUnits; u++) {
+        if (units[u].empty() && unitWords > 0) {
+            units[u].resize(unitWords);
+            ifs.seekg(u * unitWords * sizeof(uint64_t), std::ios::beg);
+            ifs.read(reinterpret_cast<char*>(units[u].data()), sizeof(uint64_t) * unitWords);
+            if (!ifs) {
+                die("BloomFilter::setEnabledUnits: Failed to read unit " + std::to_string(u) + " from the filter file");
+            }
+        }
+    }
+    enabledUnits = newEnabledUnits;
+    numBits = unitBits * enabledUnits;
+    trimUnits();
+}
+
+// Free every unit that is not enabled
+void BloomFilter::trimUnits() {
+    for (size_t u = enabledUnits; u < numUnits; u++) {
+        std::vector<uint64_t>().swap(units[u]);
+    }
+}
+
+// Only the filter parameters are serialized. The bits themselves live in the run's filter file.
 json BloomFilter::serialize() const {
     json j;
     j["capacity"] = capacity;
     j["errorRate"] = errorRate;
     j["numBits"] = numBits;
     j["numHashes"] = numHashes;
-
-    std::stringstream ss;
-    ss << bits;
-    j["bits"] = ss.str();
-
+    j["numUnits"] = numUnits;
+    j["enabledUnits"] = enabledUnits;
+    j["unitBits"] = unitBits;
     return j;
 }
 
+// Restore the filter parameters. No unit is resident afterwards until setEnabledUnits() loads them. A filter saved
+// before filters had units is a single unit of all its bits.
 void BloomFilter::deserialize(const json& j) {
-    if (!j.contains("capacity") || !j.contains("errorRate") || !j.contains("numBits") || !j.contains("numHashes") || !j.contains("bits")) {
+    if (!j.contains("capacity") || !j.contains("errorRate") || !j.contains("numBits") || !j.contains("numHashes")) {
         std::cerr << "BloomFilter::deserialize: Invalid JSON format for deserializing BloomFilter. Skipping..." << std::endl;
         return;
     }
@@ -71,5 +190,8 @@ void BloomFilter::deserialize(const json& j) {
     errorRate = j["errorRate"];
     numBits = j["numBits"];
     numHashes = j["numHashes"];
-    bits = boost::dynamic_bitset<>(j["bits"].get<std::string>());
-}
\ No newline at end of file
+    numUnits = j.value("numUnits", size_t(1));
+    unitBits = j.value("unitBits", numBits);
+    enabledUnits = 0;
+    units.assign(numUnits, std::vector<uint64_t>());
+}
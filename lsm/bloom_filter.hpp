@@ -1,28 +1,59 @@
 #pragma once
-#include <boost/dynamic_bitset.hpp>
+#include <fstream>
+#include <vector>
 #include "data_types.hpp"
 #include <nlohmann/json.hpp>
 using json = nlohmann:: json;
 
+// The two hashes all filter probes of a key are derived from
+using KeyHash = std::pair<uint64_t, uint64_t>;
+
+// An ElasticBF-style Bloom filter made of independent units. Every unit is a small Bloom filter over the same keys
+// with its own hash functions, so a key is reported present only if all enabled units contain it. Only the enabled
+// units are resident in memory; the remaining units live in the run's filter file and can be loaded on demand.
 class BloomFilter {
 public:
     BloomFilter(size_t capacity, double error_rate);
 
     void add(const KEY_t key);
-    bool contains(const KEY_t key);
+    void addFingerprint(const uint32_t fingerprint);
+    bool contains(const KEY_t key) const;
+    static uint32_t fingerprint(const KEY_t key);
     json serialize() const;
     void deserialize(const json& j);
-    size_t getNumBits() { return numBits; }
-    void setNumBits(size_t numBits) { this->numBits = numBits; } 
-    int getNumHashes() { return numHashes; }
-    size_t getNumSetBits() const { return bits.count(); }
+    size_t getNumBits() const { return numBits; }
+    void setNumBits(size_t numBits) { this->numBits = numBits; }
+    int getNumHashes() const { return numHashes; }
+    size_t getNumSetBits() const;
     void resize(size_t newNumBits);
     double theoreticalErrorRate() const;
 
+    // Probing one word at a time, for lookups that interleave their cache misses. The hashes of a key are the same in
+    // every filter, so a key probed in several runs is hashed once.
+    static KeyHash hashKey(const KEY_t key);
+    static KeyHash hashFingerprint(const uint32_t fingerprint);
+    bool containsHash(const KeyHash& hash) const;
+    size_t getNumProbes() const { return (unitBits == 0) ? 0 : enabledUnits * numHashes; }
+    const uint64_t* getProbeWord(uint64_t hash1, uint64_t hash2, size_t probe, uint64_t& mask) const;
+
+    // Elastic units
+    size_t getNumUnits() const { return numUnits; }
+    size_t getEnabledUnits() const { return enabledUnits; }
+    size_t getUnitBits() const { return unitBits; }
+    double unitErrorRate() const;
+    void writeUnits(std::ofstream& ofs) const;
+    void setEnabledUnits(size_t newEnabledUnits, std::ifstream& ifs);
+    void trimUnits();
+
 private:
     size_t capacity;
     double errorRate;
-    size_t numBits;
-    int numHashes;
-    boost::dynamic_bitset<> bits;
+    size_t numBits;       // Resident bits, i.e. unitBits * enabledUnits
+    int numHashes;        // Hash functions per unit
+    size_t numUnits;      // Units stored in the filter file
+    size_t enabledUnits;  // Units probed by contains(), always a prefix of the units
+    size_t unitBits;
+    std::vector<std::vector<uint64_t>> units; // An empty unit is not resident
+    size_t getUnitWords() const { return (unitBits + 63) / 64; }
+    void setNumHashes();
 };
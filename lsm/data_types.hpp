@@ -25,17 +25,49 @@ constexpr bool DEFAULT_VERBOSE_PRINTING = false;
 constexpr size_t DEFAULT_VERBOSE_FREQUENCY = 100000;
 constexpr bool DEFAULT_THROUGHPUT_PRINTING = false;
 constexpr size_t DEFAULT_THROUGHPUT_FREQUENCY = 1000000;
+constexpr double DEFAULT_FILTER_MEMORY_BUDGET_MB = 0;  // 0 means the Bloom filters are sized by the error rate only
+constexpr size_t DEFAULT_ROW_CACHE_CAPACITY = 0;       // Entries in the row cache, 0 disables it
+constexpr size_t DEFAULT_LEARNED_INDEX_EPSILON = 0;    // Error bound of the runs' learned indexes, 0 disables them
+constexpr double DEFAULT_BLOCK_CACHE_MB = 0;           // Memory of the block cache, 0 disables it
 
 // LSM TREE DEFINITIONS
 constexpr int STATS_PRINT_EVERYTHING = -1;
 constexpr int NUM_LOGICAL_PAIRS_NOT_CACHED = -1;
+constexpr size_t GET_BATCH_SIZE = 64;  // Consecutive benchmark gets looked up together
+constexpr size_t INTERLEAVED_LOOKUP_GROUP_SIZE = 16;  // Lookups of a batch whose cache misses are in flight together
+constexpr size_t INTERLEAVED_LOOKUP_L2_MULTIPLE = 24; // Filters smaller than this many L2 caches are probed in a plain loop
+constexpr size_t INTERLEAVED_LOOKUP_MIN_KEYS = 64;   // Batches that probe a filter with fewer keys use a plain loop
+constexpr size_t DEFAULT_L2_CACHE_BYTES = 1024 * 1024; // Assumed where the size of the L2 cache cannot be queried
 
 // BLOOM FILTER DEFINITIONS
 constexpr float BLOOM_FILTER_UNUSED = -1.0f;
+constexpr size_t DEFAULT_BLOOM_FILTER_UNITS = 6;            // Units built and stored for every run
+constexpr size_t DEFAULT_BLOOM_FILTER_RESIDENT_UNITS = 4;   // Units enabled when a run is created
+constexpr size_t BLOOM_FILTER_MIN_UNITS = 1;                // The tuner never disables a run's last unit
+constexpr size_t BLOOM_TUNER_INTERVAL_MS = 1000;
+constexpr double BLOOM_TUNER_DECAY = 0.5;                   // Weight of past probes in a run's access frequency
+constexpr double BLOOM_FILTER_MIN_ERROR_RATE = 1e-9;        // Lower bound for error rates derived from the memory budget
+constexpr double FILTER_BUDGET_REBUILD_TOLERANCE = 0.1;     // Relative size change that makes a filter worth rebuilding
+constexpr size_t BLOOM_FILTER_PARTITION_PAGES = 1;          // Run pages whose keys share a filter partition
+
+// ROW CACHE DEFINITIONS
+constexpr size_t ROW_CACHE_NUM_SHARDS = 16;
+constexpr size_t ROW_CACHE_SKETCH_DEPTH = 4;          // Rows of the TinyLFU count-min sketch
+constexpr size_t ROW_CACHE_SKETCH_WIDTH_FACTOR = 4;   // Sketch counters per row for every cache entry
+constexpr size_t ROW_CACHE_SKETCH_SAMPLE_FACTOR = 10; // Accesses per cache entry before the sketch counters are halved
+constexpr uint8_t ROW_CACHE_SKETCH_COUNTER_MAX = 15;
+
+// BLOCK CACHE DEFINITIONS
+constexpr size_t BLOCK_CACHE_NUM_SHARDS = 16;
+constexpr size_t BLOCK_CACHE_MIN_SHARD_BYTES = 512 * 1024; // Smallest shard, which holds 16 full pages
 
 // FILE DEFINITIONS
 const std::string LSM_TREE_JSON_FILE = "lsm-tree.json";
 const std::string SSTABLE_FILE_TEMPLATE = "lsm-";
+const std::string BLOOM_FILTER_FILE_EXTENSION = ".bf";
+const std::string FINGERPRINT_FILE_EXTENSION = ".fp";
+const std::string PARTITIONED_FILTER_FILE_EXTENSION = ".pf";
+constexpr size_t FINGERPRINT_READ_BATCH = 65536; // Fingerprints read at a time when rebuilding a Bloom filter
 
 // DISK DEFINITIONS
 constexpr int NUM_DISK_TYPES = 5;
@@ -53,12 +85,29 @@ constexpr int DISK5_PENALTY_MULTIPLIER = 135;
 
 // FIRST LEVEL DEFINITION
 constexpr int FIRST_LEVEL_NUM = 1;
+constexpr size_t MAX_LEVEL_GET_STATS = 64; // Levels with get statistics of their own, deeper levels share the last
 
 // RUN DEFINITIONS
 constexpr int FILE_DESCRIPTOR_UNINITIALIZED = -1;
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr size_t FENCE_INDEX_EYTZINGER_MIN_FENCES = 16; // Smaller fence arrays are searched in key order
+constexpr size_t FENCE_INDEX_PREFETCH_STRIDE = CACHE_LINE_SIZE / sizeof(KEY_t); // Eytzinger slots per cache line
+constexpr size_t LEARNED_INDEX_WINDOW_SLACK = 2;        // Positions read on each side of a learned index prediction beyond epsilon
+constexpr int RUN_INTERVAL_INDEX_SCAN_HEIGHT = 3;       // Interval subtrees this short are scanned instead of searched
+constexpr size_t PARALLEL_RANGE_MIN_PAGES = 16;         // Ranges over fewer run pages are merged by a single thread
+constexpr size_t PARALLEL_RANGE_CHUNK_PAIRS = 4096;     // Live pairs a range piece hands over at a time
+constexpr size_t PARALLEL_RANGE_QUEUED_CHUNKS = 4;      // Chunks a range piece merges ahead of the caller
+constexpr double BLOCK_HASH_INDEX_UTILIZATION = 0.75;   // Keys per home bucket of a page's hash index
+constexpr size_t BLOCK_HASH_INDEX_PROBE_BUCKETS = 32;   // Buckets from its home bucket on that may hold a key, read at once
+constexpr int BLOCK_HASH_INDEX_SLOT_BITS = 12;          // Low bits of a bucket that hold a slot, the rest hold its key's tag
+constexpr uint16_t BLOCK_HASH_INDEX_EMPTY = 0;          // Bucket that holds no key, whose tag is 0
+constexpr size_t PAIRED_READ_MAX_ENTRIES = 256;         // Positions of a columnar page read with their values at once
+constexpr int KEY_SKETCH_REGISTER_BITS = 10;            // A run's key sketch has 2^10 registers, for about 3% error
 
 // CLIENT / SERVER DEFINITIONS
 constexpr int BUFFER_SIZE = 4096;
+constexpr size_t RANGE_STREAM_BATCH_SIZE = 16 * BUFFER_SIZE; // Bytes of a range response sent at once while it is merged
+constexpr size_t MAX_RANGE_CURSORS_PER_CLIENT = 64;         // Range cursors a client may hold open at once
 constexpr int DEFAULT_SERVER_PORT = 1234;
 const std::string END_OF_MESSAGE = "<END_OF_MESSAGE>";
 const std::string NO_VALUE = "<NO_VALUE>";
@@ -71,14 +120,21 @@ struct kvPair {
     VAL_t value;
 };
 
-// Helper structure for priority queues
-struct PQEntry {
-    KEY_t key;
-    VAL_t value;
-    size_t runIdx;
-    typename std::vector<kvPair>::iterator vecIter;
+// Statistics of the pairs of a run's page, written with the run, so an aggregate that covers a whole page needs not read it
+struct BlockStats {
+    KEY_t lastKey;
+    size_t count;  // Pairs that are not tombstones, which the sum, minimum and maximum are over
+    int64_t sum;
+    VAL_t minValue;
+    VAL_t maxValue;
+    size_t tombstones;
+};
 
-    bool operator<(const PQEntry& other) const {
-        return key > other.key; // Min heap based on key
-    }
+// The estimated size of a range, taken from the fence pointers and page statistics without reading any page
+struct RangeEstimate {
+    size_t pairs = 0; // Pairs that are not tombstones, counting each version of a key that is in several sources
+    size_t pages = 0; // Run pages the range overlaps
+    size_t tombstones = 0; // Tombstones of the run pages in the range, which pairs leaves out
+    size_t bytes() const { return pairs * sizeof(kvPair); }
 };
+
@@ -0,0 +1,92 @@
+#include <cstring>
+#include <bit>
+#include "../lib/binary_search.hpp"
+#include "fence_index.hpp"
+#include "utils.hpp"
+
+namespace {
+// Allocate an array of count elements aligned to a cache line
+template<typename T>
+T* allocateAligned(size_t count) {
+    size_t bytes = (count * sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    void* ptr = std::aligned_alloc(CACHE_LINE_SIZE, std::max<size_t>(bytes, CACHE_LINE_SIZE));
+    if (ptr == nullptr) {
+        die("FenceIndex: Failed to allocate " + std::to_string(bytes) + " bytes");
+    }
+    return static_cast<T*>(ptr);
+}
+}
+
+FenceIndex::FenceIndex(const std::vector<KEY_t>& fences) : numFences(fences.size()) {
+    if (numFences == 0) {
+        return;
+    }
+    sorted.reset(allocateAligned<KEY_t>(numFences));
+    std::memcpy(sorted.get(), fences.data(), sizeof(KEY_t) * numFences);
+    if (numFences < FENCE_INDEX_EYTZINGER_MIN_FENCES) {
+        return;
+    }
+    eytzinger.reset(allocateAligned<KEY_t>(numFences + 1));
+    ranks.reset(allocateAligned<uint32_t>(numFences + 1));
+    eytzinger[0] = KEY_MIN;
+    ranks[0] = 0;
+    buildEytzinger(0, 1);
+}
+
+// Fill the subtree rooted at slot with the fences starting at sortedIdx by an in-order walk, and return the index of
+// the first fence not placed
+size_t FenceIndex::buildEytzinger(size_t sortedIdx, size_t slot) {
+    if (slot <= numFences) {
+        sortedIdx = buildEytzinger(sortedIdx, 2 * slot);
+        eytzinger[slot] = sorted[sortedIdx];
+        ranks[slot] = static_cast<uint32_t>(sortedIdx);
+        sortedIdx = buildEytzinger(sortedIdx + 1, 2 * slot + 1);
+    }
+    return sortedIdx;
+}
+
+// Return the index of the page that may hold the key, i.e. the last fence that is not greater than the key. Keys
+// before the first fence map to page 0; callers check the run's key range first.
+size_t FenceIndex::findPage(KEY_t key) const {
+    if (numFences == 0) {
+        return 0;
+    }
+    if (eytzinger) {
+        // Descend going right while the fence is not greater than the key. The descendants four levels down share a
+        // cache line, so it is requested while the levels in between are compared.
+        size_t slot = 1;
+        while (slot <= numFences) {
+            __builtin_prefetch(eytzinger.get() + std::min(slot * FENCE_INDEX_PREFETCH_STRIDE, numFences));
+            slot = 2 * slot + (eytzinger[slot] <= key);
+        }
+        return getSearchResult(slot);
+    }
+    // Find the first fence greater than the key
+    size_t upper = branchless_lower_bound(sorted.get(), sorted.get() + numFences, key,
+                                          [](KEY_t fence, KEY_t k) { return fence <= k; }) - sorted.get();
+    return (upper == 0) ? 0 : upper - 1;
+}
+
+// The bytes of the sorted fences and, for large fence arrays, of the Eytzinger layout and its ranks
+size_t FenceIndex::getMemoryBytes() const {
+    size_t bytes = numFences * sizeof(KEY_t);
+    if (eytzinger) {
+        bytes += (numFences + 1) * (sizeof(KEY_t) + sizeof(uint32_t));
+    }
+    return bytes;
+}
+
+// Take one step of the Eytzinger descent, starting from slot 1. Return false once the descent has left the tree, at
+// which point getSearchResult() gives the page.
+bool FenceIndex::searchStep(size_t& slot, KEY_t key) const {
+    slot = 2 * slot + (eytzinger[slot] <= key);
+    return slot <= numFences;
+}
+
+// Map the slot where an Eytzinger descent left the tree to the page of the last fence that is not greater than the key
+size_t FenceIndex::getSearchResult(size_t slot) const {
+    // Undo the right turns taken after the last left turn. Slot 0 means no fence is greater than the key.
+    slot >>= std::countr_one(slot) + 1;
+    size_t upper = (slot == 0) ? numFences : ranks[slot];
+    return (upper == 0) ? 0 : upper - 1;
+}
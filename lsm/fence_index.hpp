@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include "data_types.hpp"
+
+// An immutable search structure over a run's fence pointers, built once the run's fences are final. Small fence
+// arrays are searched in sorted order, which fits in a cache line or two. Larger ones are laid out in Eytzinger
+// (breadth-first) order in a cache-line aligned array, so every step of the search is a branchless descent and the
+// cache lines of the next levels can be prefetched before they are needed.
+class FenceIndex {
+public:
+    FenceIndex() = default;
+    explicit FenceIndex(const std::vector<KEY_t>& fences);
+
+    size_t findPage(KEY_t key) const;
+    size_t size() const { return numFences; }
+    size_t getMemoryBytes() const;
+
+    // The fences in key order
+    KEY_t operator[](size_t page) const { return sorted[page]; }
+    KEY_t front() const { return sorted[0]; }
+    const KEY_t* begin() const { return sorted.get(); }
+    const KEY_t* end() const { return sorted.get() + numFences; }
+
+    // Searching one Eytzinger level at a time, for lookups that interleave their cache misses. Only fence arrays laid
+    // out in Eytzinger order are searched this way; the others fit in a cache line or two and use findPage().
+    bool isEytzinger() const { return eytzinger != nullptr; }
+    const KEY_t* getSearchNode(size_t slot) const { return eytzinger.get() + slot; }
+    bool searchStep(size_t& slot, KEY_t key) const;
+    size_t getSearchResult(size_t slot) const;
+
+private:
+    struct FreeDeleter {
+        void operator()(void* ptr) const { std::free(ptr); }
+    };
+    size_t numFences = 0;
+    std::unique_ptr<KEY_t[], FreeDeleter> sorted;    // The fences in key order
+    std::unique_ptr<KEY_t[], FreeDeleter> eytzinger; // 1-indexed, empty for small fence arrays
+    std::unique_ptr<uint32_t[], FreeDeleter> ranks;  // Position in key order of each Eytzinger slot
+    size_t buildEytzinger(size_t sortedIdx, size_t slot);
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Coroutine frames of one size, recycled per thread. A batch creates a frame for every key it looks up and frees them
+// all when it is done, so the next batch reuses them instead of going to the allocator each time.
+class LookupFramePool {
+public:
+    static void* allocate(std::size_t size) {
+        FreeList& list = freeList();
+        if (size == list.frameSize && !list.frames.empty()) {
+            void* frame = list.frames.back();
+            list.frames.pop_back();
+            return frame;
+        }
+        return ::operator new(size);
+    }
+    static void deallocate(void* frame, std::size_t size) {
+        FreeList& list = freeList();
+        if (list.frames.empty()) {
+            list.frameSize = size;
+        }
+        if (size == list.frameSize) {
+            list.frames.push_back(frame);
+            return;
+        }
+        ::operator delete(frame);
+    }
+
+private:
+    struct FreeList {
+        std::size_t frameSize = 0;
+        std::vector<void*> frames;
+        ~FreeList() {
+            for (void* frame : frames) {
+                ::operator delete(frame);
+            }
+        }
+    };
+    static FreeList& freeList() {
+        thread_local FreeList list;
+        return list;
+    }
+};
+
+// A lookup written as a coroutine that suspends right before it touches memory that is likely not in the cache. While
+// the cache line is fetched, runInterleaved() resumes the other lookups of the batch, so the misses of the whole
+// batch overlap instead of being paid one after the other.
+template<typename T>
+class InterleavedLookup {
+public:
+    struct promise_type {
+        T result{};
+        InterleavedLookup get_return_object() {
+            return InterleavedLookup(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(T value) { result = std::move(value); }
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new(std::size_t size) { return LookupFramePool::allocate(size); }
+        static void operator delete(void* frame, std::size_t size) { LookupFramePool::deallocate(frame, size); }
+    };
+
+    explicit InterleavedLookup(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    InterleavedLookup(InterleavedLookup&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    InterleavedLookup(const InterleavedLookup&) = delete;
+    InterleavedLookup& operator=(const InterleavedLookup&) = delete;
+    InterleavedLookup& operator=(InterleavedLookup&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~InterleavedLookup() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool done() const { return handle.done(); }
+    void resume() { handle.resume(); }
+    const T& result() const { return handle.promise().result; }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Prefetch an address and suspend the lookup until the scheduler gets back to it
+struct PrefetchAwaiter {
+    const void* address;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) const noexcept { __builtin_prefetch(address); }
+    void await_resume() const noexcept {}
+};
+
+// Run count lookups to completion, keeping up to groupSize of them in flight and resuming them round robin. Lookup i
+// is created by start(i) once a slot is free, and finish(i, result) is called as soon as it is done, so only groupSize
+// coroutine frames are alive at a time.
+template<typename T, typename Start, typename Finish>
+void runInterleaved(size_t count, size_t groupSize, Start start, Finish finish) {
+    std::vector<InterleavedLookup<T>> inFlight;
+    std::vector<size_t> inFlightIndices;
+    size_t next = 0;
+    while (next < count && inFlight.size() < groupSize) {
+        inFlight.push_back(start(next));
+        inFlightIndices.push_back(next++);
+    }
+    while (!inFlight.empty()) {
+        for (size_t slot = 0; slot < inFlight.size();) {
+            inFlight[slot].resume();
+            if (!inFlight[slot].done()) {
+                slot++;
+                continue;
+            }
+            finish(inFlightIndices[slot], inFlight[slot].result());
+            if (next < count) {
+                inFlight[slot] = start(next);
+                inFlightIndices[slot++] = next++;
+            } else {
+                inFlight[slot] = std::move(inFlight.back());
+                inFlightIndices[slot] = inFlightIndices.back();
+                inFlight.pop_back();
+                inFlightIndices.pop_back();
+            }
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include "key_sketch.hpp"
+
+KeySketch::KeySketch(const std::vector<uint32_t>& fingerprints) : registers(size_t{1} << KEY_SKETCH_REGISTER_BITS, 0) {
+    for (uint32_t fingerprint : fingerprints) {
+        uint32_t rest = fingerprint << KEY_SKETCH_REGISTER_BITS;
+        uint8_t rank = static_cast<uint8_t>(std::min(std::countl_zero(rest), 32 - KEY_SKETCH_REGISTER_BITS) + 1);
+        uint8_t &reg = registers[fingerprint >> (32 - KEY_SKETCH_REGISTER_BITS)];
+        reg = std::max(reg, rank);
+    }
+}
+
+void KeySketch::merge(const KeySketch& other) {
+    if (empty()) {
+        registers = other.registers;
+        return;
+    }
+    for (size_t i = 0; i < registers.size() && i < other.registers.size(); i++) {
+        registers[i] = std::max(registers[i], other.registers[i]);
+    }
+}
+
+// The harmonic mean of the registers, with linear counting for small sets and the correction for 32-bit hashes filling
+// up for large ones
+double KeySketch::estimate() const {
+    if (empty()) {
+        return 0;
+    }
+    double m = static_cast<double>(registers.size());
+    double sum = 0;
+    size_t zeros = 0;
+    for (uint8_t reg : registers) {
+        sum += std::ldexp(1.0, -reg);
+        zeros += (reg == 0);
+    }
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        return m * std::log(m / static_cast<double>(zeros));
+    }
+    constexpr double HASH_SPACE = 4294967296.0;
+    if (estimate > HASH_SPACE / 30) {
+        return -HASH_SPACE * std::log(1 - estimate / HASH_SPACE);
+    }
+    return estimate;
+}
+
+json KeySketch::serialize() const {
+    return registers;
+}
+
+void KeySketch::deserialize(const json& j) {
+    registers = j.get<std::vector<uint8_t>>();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "data_types.hpp"
+#include <nlohmann/json.hpp>
+using json = nlohmann:: json;
+
+// A HyperLogLog sketch of the distinct keys of a run, built from the fingerprints of its keys. Each fingerprint picks a
+// register by its top bits and raises it to the position of the first set bit among the others. Merging the sketches of
+// several runs by taking the larger of each register gives the sketch of their union, so the number of distinct keys
+// across runs is estimated without reading them.
+class KeySketch {
+public:
+    KeySketch() = default;
+    explicit KeySketch(const std::vector<uint32_t>& fingerprints);
+
+    bool empty() const { return registers.empty(); }
+    void merge(const KeySketch& other);
+    double estimate() const;
+
+    json serialize() const;
+    void deserialize(const json& j);
+
+private:
+    std::vector<uint8_t> registers; // Empty for runs written before runs had sketches
+};
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "learned_index.hpp"
+#include "utils.hpp"
+
+// Each segment starts at a key and keeps the range of slopes that predict every key added since to within epsilon.
+// The range shrinks with every key, and the segment ends when a key would leave it empty. The segment's slope is the
+// middle of the final range.
+LearnedIndex::LearnedIndex(const std::vector<kvPair>& kvPairs, size_t epsilon) : epsilon(epsilon), size(kvPairs.size()) {
+    if (size > std::numeric_limits<uint32_t>::max()) {
+        die("LearnedIndex: Run of " + std::to_string(size) + " keys is too large for a learned index");
+    }
+    double slopeLow = 0;
+    double slopeHigh = std::numeric_limits<double>::infinity();
+    for (size_t pos = 0; pos < size; pos++) {
+        KEY_t key = kvPairs[pos].key;
+        if (!segments.empty()) {
+            const Segment &segment = segments.back();
+            double dx = static_cast<double>(static_cast<int64_t>(key) - segment.firstKey);
+            double dy = static_cast<double>(pos - segment.firstPosition);
+            double low = (dy - epsilon) / dx;
+            double high = (dy + epsilon) / dx;
+            if (dx > 0 && low <= slopeHigh && high >= slopeLow) {
+                slopeLow = std::max(slopeLow, low);
+                slopeHigh = std::min(slopeHigh, high);
+                continue;
+            }
+            segments.back().slope = std::isinf(slopeHigh) ? 0 : (slopeLow + slopeHigh) / 2;
+        }
+        segments.push_back({key, static_cast<uint32_t>(pos), 0});
+        slopeLow = 0;
+        slopeHigh = std::numeric_limits<double>::infinity();
+    }
+    if (!segments.empty()) {
+        segments.back().slope = std::isinf(slopeHigh) ? 0 : (slopeLow + slopeHigh) / 2;
+    }
+}
+
+// Return the positions [start, end) of the run that hold the key if it is present, or else the position where it would
+// be inserted. The prediction is kept between the segment's first position and the next segment's, so keys between
+// two segments are covered as well. The extra slack accounts for rounding and for keys that are not in the run.
+std::pair<size_t, size_t> LearnedIndex::findWindow(KEY_t key) const {
+    auto next = std::upper_bound(segments.begin(), segments.end(), key,
+                                 [](KEY_t k, const Segment &segment) { return k < segment.firstKey; });
+    if (next == segments.begin()) {
+        return {0, std::min(size, epsilon + LEARNED_INDEX_WINDOW_SLACK)};
+    }
+    const Segment &segment = *(next - 1);
+    double limit = (next == segments.end()) ? static_cast<double>(size) : static_cast<double>(next->firstPosition);
+    double predicted = segment.firstPosition + segment.slope * (static_cast<int64_t>(key) - segment.firstKey);
+    int64_t position = std::llround(std::clamp(predicted, static_cast<double>(segment.firstPosition), limit));
+    int64_t reach = static_cast<int64_t>(epsilon + LEARNED_INDEX_WINDOW_SLACK);
+    int64_t start = std::max<int64_t>(position - reach, 0);
+    int64_t end = std::min<int64_t>(position + reach + 1, size);
+    return {static_cast<size_t>(start), static_cast<size_t>(end)};
+}
+
+json LearnedIndex::serialize() const {
+    json j;
+    j["epsilon"] = epsilon;
+    j["size"] = size;
+    j["segments"] = json::array();
+    for (const auto &segment : segments) {
+        j["segments"].push_back({segment.firstKey, segment.firstPosition, segment.slope});
+    }
+    return j;
+}
+
+void LearnedIndex::deserialize(const json& j) {
+    epsilon = j["epsilon"];
+    size = j["size"];
+    segments.clear();
+    for (const auto &segment : j["segments"]) {
+        segments.push_back({segment[0].get<KEY_t>(), segment[1].get<uint32_t>(), segment[2].get<double>()});
+    }
+}
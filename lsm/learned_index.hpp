@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include "data_types.hpp"
+#include <nlohmann/json.hpp>
+using json = nlohmann:: json;
+
+// A piecewise linear model of a run's sorted keys, mapping a key to its position in the run file. Every segment
+// predicts the position of each of its keys to within epsilon, so a lookup only reads the window of the run around the
+// prediction instead of searching a whole page. Segments are built in one pass with the shrinking cone algorithm.
+class LearnedIndex {
+public:
+    LearnedIndex() = default;
+    LearnedIndex(const std::vector<kvPair>& kvPairs, size_t epsilon);
+
+    bool empty() const { return segments.empty(); }
+    std::pair<size_t, size_t> findWindow(KEY_t key) const;
+    size_t getEpsilon() const { return epsilon; }
+    size_t getNumSegments() const { return segments.size(); }
+    size_t getMemoryBytes() const { return segments.size() * sizeof(Segment); }
+
+    json serialize() const;
+    void deserialize(const json& j);
+
+private:
+    struct Segment {
+        KEY_t firstKey;
+        uint32_t firstPosition;
+        double slope;
+    };
+    std::vector<Segment> segments;
+    size_t epsilon = 0;
+    size_t size = 0; // Keys in the run
+};
@@ -2,11 +2,43 @@
 #include <iostream>
 #include "level.hpp"
 #include "run.hpp"
+#include "loser_tree.hpp"
 #include "lsm_tree.hpp"
 #include "utils.hpp"
 
+namespace {
+// Merge the pairs of two runs, the newer one first, keeping only the newer value of a key in both. Every step writes
+// the smaller head and moves past it, and past the older head too when their keys are equal, with no branch on the
+// keys, where the loser tree would replay its one match. Within a run every key is unique.
+void mergeTwoRuns(const std::vector<kvPair> &newer, const std::vector<kvPair> &older, bool dropTombstones,
+                  std::vector<kvPair> &merged) {
+    merged.resize(newer.size() + older.size());
+    size_t i = 0, j = 0, count = 0;
+    while (i < newer.size() && j < older.size()) {
+        kvPair newerPair = newer[i];
+        kvPair olderPair = older[j];
+        bool takeOlder = olderPair.key < newerPair.key;
+        kvPair next = takeOlder ? olderPair : newerPair;
+        merged[count] = next;
+        count += !(dropTombstones && next.value == TOMBSTONE);
+        i += !takeOlder;
+        j += takeOlder | (olderPair.key == newerPair.key);
+    }
+    // One of the runs is used up, and the rest of the other follows
+    for (; i < newer.size(); i++) {
+        merged[count] = newer[i];
+        count += !(dropTombstones && newer[i].value == TOMBSTONE);
+    }
+    for (; j < older.size(); j++) {
+        merged[count] = older[j];
+        count += !(dropTombstones && older[j].value == TOMBSTONE);
+    }
+    merged.resize(count);
+}
+}
+
 // Add run to the beginning of the Level runs queue 
-void Level::put(std::unique_ptr<Run> runPtr) {
+void Level::put(std::shared_ptr<Run> runPtr) {
     // Check if there is enough space in the level to add the run
     if (kvPairs + runPtr->getMaxKvPairs() > maxKvPairs) {
         printTrace();
@@ -17,19 +49,14 @@ void Level::put(std::unique_ptr<Run> runPtr) {
     kvPairs += runs.front()->getMaxKvPairs(); 
 }
 
-std::unique_ptr<Run> Level::compactSegment(double errorRate, std::pair<size_t, size_t> segmentBounds, bool isLastLevel) {
-    std::priority_queue<PQEntry> pq;
+std::unique_ptr<Run> Level::compactSegment(std::pair<size_t, size_t> segmentBounds, bool isLastLevel) {
     size_t newMaxKvPairs = 0;
     std::vector<std::vector<kvPair>> runVectors(segmentBounds.second - segmentBounds.first + 1);
     std::optional<KEY_t> mostRecentKey;
 
-    // Iterate through the runs in the segment, retrieve their vectors, and add the first element of each run to the priority queue
+    // Retrieve the vectors of the runs in the segment, newest first
     for (size_t idx = segmentBounds.first; idx <= segmentBounds.second; ++idx) {
         runVectors[idx - segmentBounds.first] = runs[idx]->getVector();
-        std::vector<kvPair> &runVec = runVectors[idx - segmentBounds.first];
-        if (!runVec.empty()) {
-            pq.push(PQEntry{runVec[0].key, runVec[0].value, idx, runVec.begin()});
-        }
         newMaxKvPairs += runs[idx]->getMaxKvPairs();
     }
 
@@ -37,30 +64,46 @@ std::unique_ptr<Run> Level::compactSegment(double errorRate, std::pair<size_t, s
     auto start_time = std::chrono::high_resolution_clock::now();
 
     // Create a new run with the merged data
-    auto compactedRun = std::make_unique<Run>(newMaxKvPairs, errorRate, true, levelNum, lsmTree);
+    auto compactedRun = std::make_unique<Run>(newMaxKvPairs, lsmTree->getBloomFilterErrorRate(newMaxKvPairs, levelNum), true, levelNum, lsmTree);
 
     // Create a vector to accumulate key-value pairs
     std::vector<kvPair> compactedKvPairs;
     compactedKvPairs.reserve(newMaxKvPairs);
 
-    // Merge the sorted runs using the priority queue
-    while (!pq.empty()) {
-        PQEntry top = pq.top();
-        pq.pop();
+    // A delete has no older value left to hide only if the segment reaches the oldest run of the last level
+    bool dropTombstones = isLastLevel && segmentBounds.second + 1 == runs.size();
 
-        if (!(isLastLevel && top.value == TOMBSTONE)) {
-            // Check if the key is the same as the most recent key processed to avoid duplicates
-            if (!mostRecentKey.has_value() || mostRecentKey.value() != top.key) { 
-                compactedKvPairs.push_back({top.key, top.value});
+    // Two runs, as in most compactions, are merged directly. More are merged in a loser tree, which puts the run with
+    // the smallest next key first, and the newest run among equal keys.
+    if (runVectors.size() == 2) {
+        mergeTwoRuns(runVectors[0], runVectors[1], dropTombstones, compactedKvPairs);
+    } else {
+        std::vector<size_t> positions(runVectors.size(), 0);
+        std::vector<std::optional<KEY_t>> firstKeys;
+        for (const std::vector<kvPair> &runVec : runVectors) {
+            firstKeys.push_back(runVec.empty() ? std::nullopt : std::optional<KEY_t>(runVec[0].key));
+        }
+        LoserTree<KEY_t> tree(firstKeys);
+        while (!tree.empty()) {
+            size_t run = tree.winner();
+            const std::vector<kvPair> &runVec = runVectors[run];
+            const kvPair &top = runVec[positions[run]];
+
+            // The runs are ordered newest first, so the first pair of a key holds its newest value and the rest are
+            // dropped
+            if (!mostRecentKey.has_value() || mostRecentKey.value() != top.key) {
                 mostRecentKey = top.key; // Update the most recent key processed
+                if (!(dropTombstones && top.value == TOMBSTONE)) {
+                    compactedKvPairs.push_back(top);
+                }
             }
-        }
 
-        // Add the next element from the same run to the priority queue
-        ++top.vecIter;
-        const std::vector<kvPair> &runVec = runVectors[top.runIdx - segmentBounds.first];
-        if (top.vecIter != runVec.end()) {
-            pq.push(PQEntry{top.vecIter->key, top.vecIter->value, top.runIdx, top.vecIter});
+            // Play the run's next pair against the other runs
+            if (++positions[run] < runVec.size()) {
+                tree.advance(runVec[positions[run]].key);
+            } else {
+                tree.retire();
+            }
         }
     }
     // Flush the accumulated key-value pairs to the compactedRun
@@ -75,10 +118,10 @@ std::unique_ptr<Run> Level::compactSegment(double errorRate, std::pair<size_t, s
     return compactedRun;
 }
 
-void Level::replaceSegment(std::pair<size_t, size_t> segmentBounds, std::unique_ptr<Run> compactedRun) {
-    // Close and delete files for old runs in the segment
+void Level::replaceSegment(std::pair<size_t, size_t> segmentBounds, std::shared_ptr<Run> compactedRun) {
+    // Old runs may still be read through an older tree version, so their files are deleted when the last one is released
     for (size_t idx = segmentBounds.first; idx <= segmentBounds.second; ++idx) {
-        runs[idx]->deleteFile();
+        runs[idx]->markObsolete();
     }
 
     // Replace the old runs with the compacted one
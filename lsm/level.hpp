@@ -29,8 +29,8 @@ public:
 
     Level() = default; // default constructor
     ~Level() {}; // destructor
-    std::deque<std::unique_ptr<Run>> runs; // std::deque of std::unique_ptr pointing to runs in the level
-    void put(std::unique_ptr<Run> runPtr); // adds a std::unique_ptr to the runs queue
+    std::deque<std::shared_ptr<Run>> runs; // std::deque of std::shared_ptr pointing to runs in the level, shared with the tree versions
+    void put(std::shared_ptr<Run> runPtr); // adds a std::shared_ptr to the runs queue
     size_t getLevelSize(int levelNum); 
     std::string getDiskName() const;
     int getDiskPenaltyMultiplier() const;
@@ -43,8 +43,8 @@ public:
     void setKvPairs(long kvPairs); // Set the number of kvPairs in the level
     size_t getMaxKvPairs() const; // Get the max number of kvPairs in the level
 
-    void replaceSegment(std::pair<size_t, size_t> segmentBounds, std::unique_ptr<Run> compactedRun);
-    std::unique_ptr<Run> compactSegment(double errorRate, std::pair<size_t, size_t> segmentBounds, bool isLastLevel);
+    void replaceSegment(std::pair<size_t, size_t> segmentBounds, std::shared_ptr<Run> compactedRun);
+    std::unique_ptr<Run> compactSegment(std::pair<size_t, size_t> segmentBounds, bool isLastLevel);
     std::pair<size_t, size_t> findBestSegmentToCompact(); 
     long sumOfKeyDifferences(size_t start, size_t end);
 
@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// A tournament tree over k sorted sources of integer keys, numbered from 0, that keeps the loser of every match in the
+// inner nodes. Once the winner's source has moved to its next key, only the matches on the path from that source's leaf
+// to the root are played again, one comparison per level, where a heap compares both children at every level.
+// Each node holds its key and source packed into one integer, ordered by key and then by source, so a match is a single
+// comparison without a branch, and equal keys go to the lower numbered source: a merge of sources given newest first
+// sees the newest value of a key first. A source with no keys left loses every match. With two sources, the tree is the
+// one match at the root.
+template<typename Key>
+class LoserTree {
+    static_assert(std::is_integral_v<Key> && sizeof(Key) <= sizeof(uint32_t), "keys must fit in the upper half of a node");
+
+public:
+    // Take the first key of every source, or nothing for a source that is empty
+    explicit LoserTree(const std::vector<std::optional<Key>>& heads) : k(heads.size()), nodes(std::max<size_t>(k, 1), DONE) {
+        std::vector<uint64_t> leaves(k);
+        for (size_t source = 0; source < k; source++) {
+            leaves[source] = heads[source].has_value() ? pack(*heads[source], source) : DONE;
+        }
+        if (k < 2) {
+            nodes[0] = k == 1 ? leaves[0] : DONE;
+            return;
+        }
+        // Leaf i is node k + i, and node n plays the winners of nodes 2n and 2n + 1
+        std::vector<uint64_t> winners(k);
+        for (size_t n = k - 1; n >= 1; n--) {
+            uint64_t left = 2 * n < k ? winners[2 * n] : leaves[2 * n - k];
+            uint64_t right = 2 * n + 1 < k ? winners[2 * n + 1] : leaves[2 * n + 1 - k];
+            winners[n] = std::min(left, right);
+            nodes[n] = std::max(left, right);
+        }
+        nodes[0] = winners[1];
+    }
+
+    // Whether every source is used up
+    bool empty() const { return nodes[0] == DONE; }
+    // The source with the smallest key, and that key
+    size_t winner() const { return nodes[0] & SOURCE_MASK; }
+    Key winnerKey() const { return unpack(nodes[0]); }
+
+    // The winner's source has moved on to the given key
+    void advance(Key key) { replay(pack(key, winner())); }
+    // The winner's source has no keys left
+    void retire() { replay(DONE); }
+
+    // The key that comes right after the winner's, which belongs to one of the sources that lost to the winner on its
+    // way to the root, or nothing if the other sources are used up
+    std::optional<Key> runnerUpKey() const {
+        uint64_t best = DONE;
+        for (size_t n = (k + winner()) / 2; n >= 1; n /= 2) {
+            best = std::min(best, nodes[n]);
+        }
+        if (best == DONE) {
+            return std::nullopt;
+        }
+        return unpack(best);
+    }
+
+private:
+    using UKey = std::make_unsigned_t<Key>;
+    // Flipping the sign bit of a signed key orders it as an unsigned one
+    static constexpr UKey SIGN_FLIP = std::is_signed_v<Key> ? UKey(UKey(1) << (sizeof(Key) * 8 - 1)) : UKey(0);
+    static constexpr uint64_t SOURCE_MASK = 0xFFFFFFFF;
+    static constexpr uint64_t DONE = UINT64_MAX;
+
+    size_t k;
+    std::vector<uint64_t> nodes; // The winner at 0 and the loser of the match at every inner node after it
+
+    static uint64_t pack(Key key, size_t source) {
+        return (static_cast<uint64_t>(static_cast<UKey>(key) ^ SIGN_FLIP) << 32) | source;
+    }
+    static Key unpack(uint64_t node) {
+        return static_cast<Key>(static_cast<UKey>(node >> 32) ^ SIGN_FLIP);
+    }
+
+    // Walk from the winner's leaf to the root, leaving the loser of every match behind
+    void replay(uint64_t candidate) {
+        for (size_t n = (k + winner()) / 2; n >= 1; n /= 2) {
+            uint64_t loser = std::max(nodes[n], candidate);
+            candidate = std::min(nodes[n], candidate);
+            nodes[n] = loser;
+        }
+        nodes[0] = candidate;
+    }
+};
@@ -5,9 +5,13 @@
 #include <sstream>
 #include <unistd.h>
 #include <numeric>
+#include <limits>
+#include <cmath>
 #include <shared_mutex>
 #include <algorithm>
 #include <filesystem>
+#include <deque>
+#include <thread>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/lock_algorithms.hpp>
@@ -15,18 +19,62 @@
 #include "run.hpp"
 #include "utils.hpp"
 
+namespace {
+
+// A piece of a partitioned range and the chunks of its live pairs that wait to be passed on. A task merges the piece
+// until it has PARALLEL_RANGE_QUEUED_CHUNKS chunks waiting and then leaves the thread pool, to be enqueued again once
+// the caller takes a chunk, so a slow caller neither holds a pool thread nor lets the pairs pile up.
+struct RangePiece {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<kvPair>> chunks;
+    std::unique_ptr<MergeIterator> merge;
+    bool running = false;   // A task is merging the piece
+    bool done = false;      // The piece is merged to its end
+    bool cancelled = false; // The caller stopped, so no more chunks are needed
+};
+
+// Bits a Bloom filter of entries keys takes at the error rate lambda * entries, as a filter memory budget assigns it
+double budgetFilterBits(double lambda, size_t entries) {
+    const double ln2Squared = std::log(2) * std::log(2);
+    double errorRate = std::clamp(lambda * entries, BLOOM_FILTER_MIN_ERROR_RATE, 1.0);
+    return -static_cast<double>(entries) * std::log(errorRate) / ln2Squared;
+}
+
+}
+
 LSMTree::LSMTree(float bfErrorRate, int buffer_num_pages, int fanout, Level::Policy levelPolicy, size_t numThreads,
-                 float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency) :
-    bfErrorRate(bfErrorRate), fanout(fanout), levelPolicy(levelPolicy), bfFalsePositives(0), bfTruePositives(0),
+                 float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency,
+                 double filterMemoryBudgetMB, bool optimizeForHits, size_t rowCacheCapacity, bool parallelGets,
+                 size_t learnedIndexEpsilon, bool blockHashIndex, double blockCacheMB, bool partitionedFilters) :
+    bfErrorRate(bfErrorRate), fanout(fanout), levelPolicy(levelPolicy),
     buffer(buffer_num_pages * getpagesize() / sizeof(kvPair)), threadPool(numThreads), compactionPercentage(compactionPercentage),
-    dataDirectory(dataDirectory), throughputPrinting(throughputPrinting), throughputFrequency(throughputFrequency)
+    dataDirectory(dataDirectory), throughputPrinting(throughputPrinting), throughputFrequency(throughputFrequency),
+    rowCache(std::make_unique<RowCache>(rowCacheCapacity)), parallelGets(parallelGets), learnedIndexEpsilon(learnedIndexEpsilon),
+    blockHashIndex(blockHashIndex), blockCache(std::make_unique<BlockCache>(blockCacheMB * 1024 * 1024)),
+    partitionedFilters(partitionedFilters),
+    filterMemoryBudgetBits(filterMemoryBudgetMB * 1024 * 1024 * 8), optimizeForHits(optimizeForHits)
 {
     // Create the first level
     levels.emplace_back(std::make_unique<Level>(buffer.getMaxKvPairs(), fanout, levelPolicy, FIRST_LEVEL_NUM, this));
     levelIoCountAndTime.push_back(std::make_pair(0, std::chrono::microseconds()));
+    publishVersion(nullptr);
     SyncedCout() << "Page size: " << getpagesize() << std::endl;
 }
 
+LSMTree::~LSMTree() {
+    {
+        std::unique_lock<std::mutex> lock(bloomFilterTunerMutex);
+        stopBloomFilterTuner = true;
+    }
+    bloomFilterTunerCv.notify_all();
+    if (bloomFilterTunerThread.joinable()) {
+        bloomFilterTunerThread.join();
+    }
+    // Parallel gets return without waiting for the reads of older runs, which use the caches and counters below
+    threadPool.waitForAllTasks();
+}
+
 void LSMTree::calculateAndPrintThroughput() {
     double slidingWindowThroughput;
     double overallThroughput;
@@ -80,6 +128,7 @@ void LSMTree::calculateAndPrintThroughput() {
 void LSMTree::put(KEY_t key, VAL_t val) {
     size_t bufferMaxKvPairs;
     std::vector<kvPair> bufferVector;
+    std::shared_ptr<const Memtable> frozenBuffer;
 
     if (throughputPrinting) {
         calculateAndPrintThroughput();
@@ -92,19 +141,25 @@ void LSMTree::put(KEY_t key, VAL_t val) {
     }
     {
         std::unique_lock<std::shared_mutex> lock(bufferMutex);
+        lastSequenceNumber++;
         // Do all buffer operations while protected by the bufferMutex
         if(buffer.put(key, val)) {
+            rowCache->invalidate(key);
             return;
         }
-        // Buffer is full
-        bufferVector.reserve(buffer.size());
-        // Copy the buffer into a vector of kvPairs
-        std::transform(buffer.begin(), buffer.end(), std::back_inserter(bufferVector),
-                       [](const auto &kv) { return kvPair{kv.first, kv.second}; });
+        // Buffer is full. Readers check the buffer before the tree version, so the full buffer is published as an
+        // immutable memtable before it is cleared, and its keys stay visible until the flushed run replaces it.
+        frozenBuffer = std::make_shared<const Memtable>(buffer);
+        publishFrozenBuffer(frozenBuffer);
         bufferMaxKvPairs = buffer.getMaxKvPairs();
         buffer.clear();
         buffer.put(key, val);
+        rowCache->invalidate(key);
     }
+    // Copy the frozen buffer into a vector of kvPairs
+    bufferVector.reserve(frozenBuffer->size());
+    std::transform(frozenBuffer->begin(), frozenBuffer->end(), std::back_inserter(bufferVector),
+                   [](const auto &kv) { return kvPair{kv.first, kv.second}; });
 
     // Lock the first level
     firstLevelLock = std::unique_lock<std::shared_mutex>(levels.front()->levelMutex);
@@ -121,7 +176,7 @@ void LSMTree::put(KEY_t key, VAL_t val) {
     start_time = std::chrono::high_resolution_clock::now();
 
     // Create a new run and add a unique pointer to it to the first level
-    levels.front()->put(std::make_unique<Run>(bufferMaxKvPairs, bfErrorRate, true, FIRST_LEVEL_NUM, this));
+    levels.front()->put(std::make_unique<Run>(bufferMaxKvPairs, getBloomFilterErrorRate(bufferMaxKvPairs, FIRST_LEVEL_NUM), true, FIRST_LEVEL_NUM, this));
     // Save the first and last keys for partial compaction
     levels.front()->runs.front()->setFirstAndLastKeys(bufferVector.front().key, bufferVector.back().key);
 
@@ -149,6 +204,34 @@ void LSMTree::put(KEY_t key, VAL_t val) {
         executeCompactionPlan();
         clearCompactionPlan();
     }
+    publishVersion(frozenBuffer.get());
+    updateFilterBudgetLambda();
+}
+
+// Publish a version with a full buffer in front of the immutable memtables. Precondition: the buffer is exclusively locked.
+void LSMTree::publishFrozenBuffer(std::shared_ptr<const Memtable> frozenBuffer) {
+    std::lock_guard<std::mutex> lock(versionMutex);
+    auto version = std::make_shared<TreeVersion>(*currentVersion.load());
+    version->immutableMemtables.insert(version->immutableMemtables.begin(), std::move(frozenBuffer));
+    currentVersion.store(std::move(version));
+}
+
+// Publish a version with the current runs of every level, dropping the memtable that was just flushed to a run.
+// Precondition: the first level is exclusively locked, so no other writer changes the levels while they are copied.
+void LSMTree::publishVersion(const Memtable* flushedMemtable) {
+    auto version = std::make_shared<TreeVersion>();
+    for (const auto& level : levels) {
+        std::vector<std::shared_ptr<Run>> runs(level->runs.begin(), level->runs.end());
+        RunIntervalIndex intervals(runs);
+        version->levels.push_back({std::move(runs), std::move(intervals)});
+    }
+    std::lock_guard<std::mutex> lock(versionMutex);
+    for (const auto& memtable : currentVersion.load()->immutableMemtables) {
+        if (memtable.get() != flushedMemtable) {
+            version->immutableMemtables.push_back(memtable);
+        }
+    }
+    currentVersion.store(std::move(version));
 }
 
 // Move runs until the first level has space. Precondition: the currentLevelNum is exclusively locked.
@@ -238,7 +321,7 @@ void LSMTree::executeCompactionPlan() {
         std::tie(start, end) = segmentBounds;
         auto &level = levels[levelNum - 1];
         auto task = [this, &level, start, end] {
-            auto compactedRun = level->compactSegment(bfErrorRate, {start, end}, isLastLevel(level->getLevelNum()));
+            auto compactedRun = level->compactSegment({start, end}, isLastLevel(level->getLevelNum()));
             level->replaceSegment({start, end}, std::move(compactedRun));
         };
         compactResults.push_back(threadPool.enqueue(task));
@@ -260,13 +343,6 @@ std::vector<Level*> LSMTree::getLocalLevelsCopy() {
     return localLevelsCopy;
 }
 
-// Remove all TOMBSTONES from a given std::unique_ptr<std::vector<kvPair>> rangeResult
-void LSMTree::removeTombstones(std::unique_ptr<std::vector<kvPair>> &rangeResult) {
-    rangeResult->erase(std::remove_if(rangeResult->begin(), rangeResult->end(),
-                                      [](const kvPair &kv) { return kv.value == TOMBSTONE; }),
-                       rangeResult->end());
-}
-
 // Given a key, search the tree for the key. If the key is found, return the value, otherwise return a nullptr. 
 std::unique_ptr<VAL_t> LSMTree::get(KEY_t key) {
     if (throughputPrinting) {
@@ -280,6 +356,20 @@ std::unique_ptr<VAL_t> LSMTree::get(KEY_t key) {
         SyncedCerr() << "LSMTree::get: Key " << key << " is not within the range of available keys. Skipping..." << std::endl;
         return nullptr;
     }
+    // The row cache is checked before the buffer, so a put that lands after the lookup also invalidates its epoch
+    RowCache::Result cached;
+    uint64_t cacheEpoch = 0;
+    if (rowCache->lookup(key, cached, cacheEpoch)) {
+        if (!cached.has_value()) {
+            incrementGetMisses();
+            return nullptr;
+        }
+        incrementGetHits();
+        if (*cached == TOMBSTONE) {
+            return nullptr;
+        }
+        return std::make_unique<VAL_t>(*cached);
+    }
     {
         std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
         val = buffer.get(key);
@@ -291,135 +381,824 @@ std::unique_ptr<VAL_t> LSMTree::get(KEY_t key) {
         }
         return val;
     }
-    std::vector<Level*> localLevelsCopy = getLocalLevelsCopy();
+    // Pin the current version. Nothing below takes a lock, and the runs stay readable even if they are compacted away.
+    std::shared_ptr<const TreeVersion> version = currentVersion.load();
+    val = getFromVersion(key, *version);
+    if (val != nullptr) {
+        incrementGetHits();
+        rowCache->insert(key, *val, cacheEpoch);
+        // Check that val is not the TOMBSTONE
+        if (*val == TOMBSTONE) {
+            return nullptr;
+        }
+        return val;
+    }
+    incrementGetMisses();
+    rowCache->insert(key, std::nullopt, cacheEpoch);
+    return nullptr;  // If the key is not found in the buffer or the levels, return nullptr
+}
 
-    // If the key is not found in the buffer, search the levels
-    for (auto level = localLevelsCopy.begin(); level != localLevelsCopy.end(); level++) {
-        {
-            // Lock the level with a shared lock
-            std::shared_lock<std::shared_mutex> levelLock((*level)->levelMutex);
-            // Iterate through the runs in the level and check if the key is in the run
-            for (auto run = (*level)->runs.begin(); run != (*level)->runs.end(); run++) {
-                val = (*run)->get(key);
-                // If the key is found in the run, break from the inner loop
-                if (val != nullptr) {
-                    break;
-                }
+// Get the value of a key as of a snapshot. The row cache holds the current values, so it is bypassed.
+std::unique_ptr<VAL_t> LSMTree::get(KEY_t key, const TreeVersion& snapshot) {
+    if (throughputPrinting) {
+        calculateAndPrintThroughput();
+    }
+    if (key < KEY_MIN || key > KEY_MAX) {
+        SyncedCerr() << "LSMTree::get: Key " << key << " is not within the range of available keys. Skipping..." << std::endl;
+        return nullptr;
+    }
+    std::unique_ptr<VAL_t> val = getFromVersion(key, snapshot);
+    if (val == nullptr) {
+        incrementGetMisses();
+        return nullptr;
+    }
+    incrementGetHits();
+    if (*val == TOMBSTONE) {
+        return nullptr;
+    }
+    return val;
+}
+
+// Search the immutable memtables and then the levels of a version for the newest value of a key, which may be a
+// tombstone. Returns nullptr if no run or memtable of the version holds the key.
+std::unique_ptr<VAL_t> LSMTree::getFromVersion(KEY_t key, const TreeVersion& version) {
+    std::unique_ptr<VAL_t> val;
+    for (const auto& memtable : version.immutableMemtables) {
+        val = memtable->get(key);
+        if (val != nullptr) {
+            return val;
+        }
+    }
+    // If the key is not found in the memtables, search the levels
+    if (parallelGets) {
+        return getFromLevelsInParallel(key, version);
+    }
+    for (const auto& level : version.levels) {
+        // Iterate through the runs in the level whose key range holds the key and check if the key is in the run
+        for (size_t r : level.intervals.findRuns(key, key)) {
+            val = level.runs[r]->get(key);
+            // If the key is found in the run, the runs of older levels hold older values
+            if (val != nullptr) {
+                return val;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Search the levels of a version for a key by reading all the runs whose Bloom filters pass at the same time on the
+// thread pool. The filters are probed in order on the calling thread, and the reads are then waited for newest first,
+// so the first read that finds the key holds its newest value. Once a read finds the key, the reads of older runs that
+// have not started yet are skipped.
+std::unique_ptr<VAL_t> LSMTree::getFromLevelsInParallel(KEY_t key, const TreeVersion& version) {
+    std::vector<std::shared_ptr<Run>> candidates;
+    for (const auto& level : version.levels) {
+        for (size_t r : level.intervals.findRuns(key, key)) {
+            if (level.runs[r]->mayContain(key)) {
+                candidates.push_back(level.runs[r]);
             }
         }
-        // If the key is found in any run within the level, break from the outer loop
+    }
+    if (candidates.empty()) {
+        return nullptr;
+    }
+    if (candidates.size() == 1) {
+        return candidates.front()->readValue(key);
+    }
+    // The position of the newest candidate known to hold the key
+    auto newestFound = std::make_shared<std::atomic<size_t>>(candidates.size());
+    std::vector<std::future<std::unique_ptr<VAL_t>>> futures;
+    futures.reserve(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++) {
+        futures.push_back(threadPool.enqueue([key, i, run = candidates[i], newestFound]() -> std::unique_ptr<VAL_t> {
+            if (newestFound->load(std::memory_order_acquire) < i) {
+                return nullptr; // A newer run already answered
+            }
+            std::unique_ptr<VAL_t> val = run->readValue(key);
+            if (val != nullptr) {
+                size_t current = newestFound->load(std::memory_order_relaxed);
+                while (i < current && !newestFound->compare_exchange_weak(current, i, std::memory_order_acq_rel)) {}
+            }
+            return val;
+        }));
+    }
+    // The first value found in recency order is the answer, since every newer run has then answered null. The reads of
+    // older runs still running are left behind: they hold their run and the flag, and their results are dropped.
+    for (auto &future : futures) {
+        std::unique_ptr<VAL_t> val = future.get();
         if (val != nullptr) {
+            return val;
+        }
+    }
+    return nullptr;
+}
+
+// Look up a batch of keys with the same result as calling get() on each of them, walking the tree once. Keys in the row
+// cache are answered first, and the rest are sorted and deduplicated. The buffer and the immutable memtables are probed
+// once for all of them, then every level resolves its remaining keys together: each of its runs probes its Bloom
+// filter and fence pointers for the whole batch, reusing the key hashes computed here, and reads each page once, with
+// the runs searched in parallel on the thread pool. A key found in several runs of a level takes the value of the
+// newest one.
+std::vector<std::unique_ptr<VAL_t>> LSMTree::multiGet(const std::vector<KEY_t>& keys) {
+    std::vector<std::unique_ptr<VAL_t>> values(keys.size());
+    std::vector<KEY_t> validKeys;
+    std::vector<size_t> validIndices;
+    std::vector<uint64_t> cacheEpochs;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (throughputPrinting) {
+            calculateAndPrintThroughput();
+        }
+        if (keys[i] < KEY_MIN || keys[i] > KEY_MAX) {
+            SyncedCerr() << "LSMTree::multiGet: Key " << keys[i] << " is not within the range of available keys. Skipping..." << std::endl;
+            continue;
+        }
+        RowCache::Result cached;
+        uint64_t cacheEpoch = 0;
+        if (rowCache->lookup(keys[i], cached, cacheEpoch)) {
+            if (!cached.has_value()) {
+                incrementGetMisses();
+                continue;
+            }
             incrementGetHits();
-            // Check that val is not the TOMBSTONE
-            if (*val == TOMBSTONE) {
-                return nullptr;
+            if (*cached != TOMBSTONE) {
+                values[i] = std::make_unique<VAL_t>(*cached);
             }
-            return val;
+            continue;
         }
+        validKeys.push_back(keys[i]);
+        validIndices.push_back(i);
+        cacheEpochs.push_back(cacheEpoch);
     }
-    incrementGetMisses();
-    return nullptr;  // If the key is not found in the buffer or the levels, return nullptr
+    std::vector<KEY_t> sortedKeys(validKeys);
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+    sortedKeys.erase(std::unique(sortedKeys.begin(), sortedKeys.end()), sortedKeys.end());
+    std::vector<KeyHash> sortedHashes(sortedKeys.size());
+    std::transform(sortedKeys.begin(), sortedKeys.end(), sortedHashes.begin(), BloomFilter::hashKey);
+
+    std::vector<std::unique_ptr<VAL_t>> found(sortedKeys.size());
+    std::vector<bool> foundInBuffer(sortedKeys.size());
+    {
+        std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
+        for (size_t i = 0; i < sortedKeys.size(); i++) {
+            found[i] = buffer.get(sortedKeys[i]);
+            foundInBuffer[i] = (found[i] != nullptr);
+        }
+    }
+    std::shared_ptr<const TreeVersion> version = currentVersion.load();
+    for (const auto& memtable : version->immutableMemtables) {
+        for (size_t i = 0; i < sortedKeys.size(); i++) {
+            if (found[i] == nullptr) {
+                found[i] = memtable->get(sortedKeys[i]);
+            }
+        }
+    }
+    for (const auto& level : version->levels) {
+        std::vector<KEY_t> pendingKeys;
+        std::vector<KeyHash> pendingHashes;
+        std::vector<size_t> pendingIndices;
+        for (size_t i = 0; i < sortedKeys.size(); i++) {
+            if (found[i] == nullptr) {
+                pendingKeys.push_back(sortedKeys[i]);
+                pendingHashes.push_back(sortedHashes[i]);
+                pendingIndices.push_back(i);
+            }
+        }
+        if (pendingKeys.empty()) {
+            break;
+        }
+        // Only the runs whose key range overlaps the pending keys can hold any of them
+        std::vector<std::shared_ptr<Run>> levelRuns;
+        for (size_t r : level.intervals.findRuns(pendingKeys.front(), pendingKeys.back())) {
+            levelRuns.push_back(level.runs[r]);
+        }
+        std::vector<std::vector<std::unique_ptr<VAL_t>>> runResults(levelRuns.size());
+        std::vector<std::future<void>> futures;
+        for (size_t r = 0; r < levelRuns.size(); r++) {
+            runResults[r].resize(pendingKeys.size());
+            if (levelRuns.size() == 1) {
+                levelRuns[r]->getBatch(pendingKeys, pendingHashes, runResults[r]);
+            } else {
+                futures.push_back(threadPool.enqueue([&, r] {
+                    levelRuns[r]->getBatch(pendingKeys, pendingHashes, runResults[r]);
+                }));
+            }
+        }
+        for (auto &future : futures) {
+            future.get();
+        }
+        // The runs of a level are ordered newest first
+        for (size_t j = 0; j < pendingKeys.size(); j++) {
+            for (auto &results : runResults) {
+                if (results[j] != nullptr) {
+                    found[pendingIndices[j]] = std::move(results[j]);
+                    break;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < validKeys.size(); i++) {
+        size_t pos = std::lower_bound(sortedKeys.begin(), sortedKeys.end(), validKeys[i]) - sortedKeys.begin();
+        if (found[pos] == nullptr) {
+            incrementGetMisses();
+            rowCache->insert(validKeys[i], std::nullopt, cacheEpochs[i]);
+            continue;
+        }
+        incrementGetHits();
+        if (!foundInBuffer[pos]) {
+            rowCache->insert(validKeys[i], *found[pos], cacheEpochs[i]);
+        }
+        if (*found[pos] != TOMBSTONE) {
+            values[validIndices[i]] = std::make_unique<VAL_t>(*found[pos]);
+        }
+    }
+    return values;
 }
 
 // Returns a vector of all the key-value pairs in the range [start, end] or an empty vector if the range is invalid
 std::unique_ptr<std::vector<kvPair>> LSMTree::range(KEY_t start, KEY_t end) {
+    std::unique_ptr<std::vector<kvPair>> rangeResult = std::make_unique<std::vector<kvPair>>();
+    rangeResult->reserve(estimateRange(start, end).pairs);
+    scanRange(start, end, [&rangeResult](const kvPair &kv) {
+        rangeResult->push_back(kv);
+        return true;
+    });
+    return rangeResult;
+}
+
+// Estimate the size of the range [start, end) without reading any page. The buffer and the immutable memtables are
+// counted, tombstones included, and the runs are estimated from their fence pointers and page statistics without their
+// tombstones, each scaled down by the share of its keys that no newer run holds. A key with values in the buffer and the
+// runs is still counted once for each, so the estimate leans towards more pairs than the range returns.
+RangeEstimate LSMTree::estimateRange(KEY_t start, KEY_t end) {
+    // The bounds are handled as a range does, without reporting them again when the range itself follows
+    if (start > end) {
+        std::swap(start, end);
+    }
+    if (start == end) {
+        return {};
+    }
+    size_t bufferPairs;
+    std::shared_ptr<const TreeVersion> version;
+    {
+        std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
+        bufferPairs = buffer.count(start, end);
+        version = currentVersion.load();
+    }
+    RangeEstimate estimate = estimateRuns(start, end, *version);
+    estimate.pairs = static_cast<size_t>(std::llround(estimateNewestRunPairs(start, end, *version)));
+    estimate.pairs += bufferPairs;
+    for (const auto& memtable : version->immutableMemtables) {
+        estimate.pairs += memtable->count(start, end);
+    }
+    return estimate;
+}
+
+// Returns the key-value pairs in the range [start, end) as of a snapshot
+std::unique_ptr<std::vector<kvPair>> LSMTree::range(KEY_t start, KEY_t end, const TreeVersion& snapshot) {
+    std::unique_ptr<std::vector<kvPair>> rangeResult = std::make_unique<std::vector<kvPair>>();
+    scanRange(start, end, snapshot, [&rangeResult](const kvPair &kv) {
+        rangeResult->push_back(kv);
+        return true;
+    });
+    return rangeResult;
+}
+
+// Pass the live key-value pairs in the range [start, end) to the callback in key order as they are merged, until the
+// callback returns false. Returns the number of pairs passed.
+size_t LSMTree::scanRange(KEY_t start, KEY_t end, const RangeCallback& callback) {
+    return scanRange(start, end, std::numeric_limits<size_t>::max(), callback);
+}
+
+// Pass the first limit live key-value pairs in the range [start, end) to the callback. The runs are read a page at a
+// time as the merge reaches them, so the pages read depend on the limit and not on how far the range reaches.
+size_t LSMTree::scanRange(KEY_t start, KEY_t end, size_t limit, const RangeCallback& callback) {
+    std::unique_ptr<RangeCursor> cursor = pinRange(start, end);
+    if (cursor == nullptr) {
+        return 0;
+    }
+    // A whole range that spans enough pages is merged in pieces on the thread pool
+    if (limit == std::numeric_limits<size_t>::max()) {
+        std::vector<KEY_t> splitKeys = partitionRange(start, end, *cursor->version);
+        if (!splitKeys.empty()) {
+            return scanPartitions(start, end, splitKeys, cursor->bufferRange, *cursor->version, callback);
+        }
+    }
+    cursor->merge = std::make_unique<MergeIterator>(mergeRange(start, end, cursor->bufferRange, *cursor->version, true));
+    return readRangeCursor(*cursor, limit, callback);
+}
+
+// Pass the live key-value pairs in the range [start, end) as of a snapshot to the callback
+size_t LSMTree::scanRange(KEY_t start, KEY_t end, const TreeVersion& snapshot, const RangeCallback& callback) {
     if (throughputPrinting) {
         calculateAndPrintThroughput();
     }
-    std::unique_ptr<std::vector<kvPair>> rangeResult = std::make_unique<std::vector<kvPair>>();
-    std::priority_queue<PQEntry> pq;
-    std::optional<KEY_t> mostRecentKey;
+    if (!checkRangeBounds(start, end)) {
+        return 0;
+    }
+    RangeCursor cursor;
+    std::vector<KEY_t> splitKeys = partitionRange(start, end, snapshot);
+    if (!splitKeys.empty()) {
+        return scanPartitions(start, end, splitKeys, cursor.bufferRange, snapshot, callback);
+    }
+    cursor.merge = std::make_unique<MergeIterator>(mergeRange(start, end, cursor.bufferRange, snapshot, true));
+    return readRangeCursor(cursor, std::numeric_limits<size_t>::max(), callback);
+}
+
+// Open a cursor over the range [start, end) as of now, or return nullptr if the range is invalid or empty
+std::unique_ptr<RangeCursor> LSMTree::openRangeCursor(KEY_t start, KEY_t end) {
+    std::unique_ptr<RangeCursor> cursor = pinRange(start, end);
+    if (cursor != nullptr) {
+        cursor->merge = std::make_unique<MergeIterator>(mergeRange(start, end, cursor->bufferRange, *cursor->version, true));
+    }
+    return cursor;
+}
+
+// Copy the buffer's pairs in the range [start, end) and pin the current version into a cursor that has no merge yet,
+// or return nullptr if the range is invalid or empty
+std::unique_ptr<RangeCursor> LSMTree::pinRange(KEY_t start, KEY_t end) {
+    if (throughputPrinting) {
+        calculateAndPrintThroughput();
+    }
+    if (!checkRangeBounds(start, end)) {
+        return nullptr;
+    }
+    std::unique_ptr<RangeCursor> cursor = std::make_unique<RangeCursor>();
+    {
+        // The version is pinned while the buffer is locked, so no flush can move keys between the two and the range
+        // sees a single point in time
+        std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
+        cursor->bufferRange = buffer.range(start, end);
+        cursor->version = currentVersion.load();
+    }
+    return cursor;
+}
+
+// Pass up to limit of the cursor's next live key-value pairs to the callback, stopping early if it returns false.
+// Returns the number of pairs passed.
+size_t LSMTree::readRangeCursor(RangeCursor& cursor, size_t limit, const RangeCallback& callback) {
+    size_t count = 0;
+    for (MergeIterator &it = *cursor.merge; it.valid() && count < limit; it.next()) {
+        // A tombstone hides the key's older values and is not part of the result
+        if (it.current().value == TOMBSTONE) {
+            continue;
+        }
+        count++;
+        if (!callback(it.current())) {
+            it.next();
+            break;
+        }
+    }
+
+    // Update range hits and misses
+    if (count > 0) {
+        incrementRangeHits();
+    } else {
+        incrementRangeMisses();
+    }
+    return count;
+}
+
+void RangeAggregate::add(VAL_t value) {
+    count++;
+    sum += value;
+    minValue = std::min(minValue, value);
+    maxValue = std::max(maxValue, value);
+}
+
+void RangeAggregate::add(const BlockStats& stats) {
+    if (stats.count == 0) {
+        return;
+    }
+    count += stats.count;
+    sum += stats.sum;
+    minValue = std::min(minValue, stats.minValue);
+    maxValue = std::max(maxValue, stats.maxValue);
+}
+
+// Return the count, sum, minimum and maximum of the live values in the range [start, end) without building the range
+RangeAggregate LSMTree::aggregateRange(KEY_t start, KEY_t end) {
+    std::unique_ptr<RangeCursor> cursor = openRangeCursor(start, end);
+    if (cursor == nullptr) {
+        return {};
+    }
+    return aggregateMerge(*cursor->merge);
+}
+
+// Return the aggregates of the live values in the range [start, end) as of a snapshot
+RangeAggregate LSMTree::aggregateRange(KEY_t start, KEY_t end, const TreeVersion& snapshot) {
+    if (throughputPrinting) {
+        calculateAndPrintThroughput();
+    }
+    if (!checkRangeBounds(start, end)) {
+        return {};
+    }
+    RangeCursor cursor;
+    cursor.merge = std::make_unique<MergeIterator>(mergeRange(start, end, cursor.bufferRange, snapshot, true));
+    return aggregateMerge(*cursor.merge);
+}
+
+// Aggregate the values a merge yields. Pages that the merge can take as a whole are added from their statistics
+// without being read, and the other pairs are added one by one, skipping tombstones.
+RangeAggregate LSMTree::aggregateMerge(MergeIterator& it) {
+    RangeAggregate aggregate;
+    while (it.valid()) {
+        if (const BlockStats* stats = it.currentBlock()) {
+            aggregate.add(*stats);
+            it.skipBlock();
+            continue;
+        }
+        if (it.current().value != TOMBSTONE) {
+            aggregate.add(it.current().value);
+        }
+        it.next();
+    }
+
+    // Update range hits and misses
+    if (aggregate.count > 0) {
+        incrementRangeHits();
+    } else {
+        incrementRangeMisses();
+    }
+    return aggregate;
+}
+
+// Pass the live pairs in the range [start, end) whose value is between low and high, both included, to the callback
+size_t LSMTree::filterRange(KEY_t start, KEY_t end, VAL_t low, VAL_t high, const RangeCallback& callback) {
+    std::unique_ptr<RangeCursor> cursor = openRangeCursor(start, end);
+    if (cursor == nullptr) {
+        return 0;
+    }
+    return filterMerge(*cursor->merge, low, high, callback);
+}
+
+// Pass the live pairs in the range [start, end) whose value is between low and high as of a snapshot to the callback
+size_t LSMTree::filterRange(KEY_t start, KEY_t end, VAL_t low, VAL_t high, const TreeVersion& snapshot,
+                            const RangeCallback& callback) {
+    if (throughputPrinting) {
+        calculateAndPrintThroughput();
+    }
+    if (!checkRangeBounds(start, end)) {
+        return 0;
+    }
+    RangeCursor cursor;
+    cursor.merge = std::make_unique<MergeIterator>(mergeRange(start, end, cursor.bufferRange, snapshot, true));
+    return filterMerge(*cursor.merge, low, high, callback);
+}
+
+// Pass the pairs a merge yields whose value is between low and high to the callback, until it returns false. A page the
+// merge can take as a whole is skipped without being read if its value range misses [low, high], since none of its
+// pairs is shadowed by a newer source and none of them hides an older one. The pairs of a page that may match are
+// selected in a loop without branches, which writes the position of every pair and only moves past the matching ones.
+size_t LSMTree::filterMerge(MergeIterator& it, VAL_t low, VAL_t high, const RangeCallback& callback) {
+    // Tombstones sort below every value, so they never match once the low end is a value
+    low = std::max(low, VAL_MIN);
+    size_t count = 0;
+    bool stopped = false;
+    std::vector<uint32_t> selection;
+    while (it.valid() && !stopped) {
+        if (const BlockStats* stats = it.currentBlock()) {
+            if (stats->count == 0 || stats->maxValue < low || stats->minValue > high) {
+                it.skipBlock();
+                continue;
+            }
+            std::span<const kvPair> pairs = it.currentBlockPairs();
+            // A page with no tombstones whose values all lie in the range is taken without looking at its values
+            if (stats->tombstones == 0 && stats->minValue >= low && stats->maxValue <= high) {
+                for (size_t i = 0; i < pairs.size() && !stopped; i++) {
+                    count++;
+                    stopped = !callback(pairs[i]);
+                }
+            } else {
+                selection.resize(pairs.size());
+                size_t selected = 0;
+                for (size_t i = 0; i < pairs.size(); i++) {
+                    selection[selected] = static_cast<uint32_t>(i);
+                    selected += static_cast<size_t>(pairs[i].value >= low) & static_cast<size_t>(pairs[i].value <= high);
+                }
+                for (size_t i = 0; i < selected && !stopped; i++) {
+                    count++;
+                    stopped = !callback(pairs[selection[i]]);
+                }
+            }
+            it.skipBlock();
+            continue;
+        }
+        const kvPair &kv = it.current();
+        if (kv.value >= low && kv.value <= high) {
+            count++;
+            stopped = !callback(kv);
+        }
+        it.next();
+    }
+
+    // Update range hits and misses
+    if (count > 0) {
+        incrementRangeHits();
+    } else {
+        incrementRangeMisses();
+    }
+    return count;
+}
 
+// Check that both range keys are valid, swapping them if the start is greater than the end. Returns false if the
+// range is invalid or empty.
+bool LSMTree::checkRangeBounds(KEY_t& start, KEY_t& end) {
     // if either start or end is not within the range of the available keys, print to the server stderr and skip it
     if (start < KEY_MIN || start > KEY_MAX || end < KEY_MIN || end > KEY_MAX) {
         SyncedCerr() << "LSMTree::range: Key " << start << " or " << end << " is not within the range of available keys. Skipping..." << std::endl;
-        return rangeResult; // Return an empty vector
+        return false;
     }
     // If the start key is greater than the end key, swap them
     if (start > end) {
         SyncedCerr() << "LSMTree::range: Start key is greater than end key. Swapping them..." << std::endl;
         std::swap(start, end);
     }
+    // If the start key is equal to the end key, the range is empty
+    return start != end;
+}
 
-    // If the start key is equal to the end key, return an empty map
-    if (start == end) {
-        return rangeResult; // Return an empty vector
+// Open a merge of the pairs of the range [start, end) from the buffer's range and a version. The sources are given to
+// the merge from newest to oldest (the buffer, the immutable memtables, then the runs level by level), so the newest
+// value of every key wins. The runs' cursors are opened on the thread pool if asked, which overlaps their first page
+// reads, and the remaining pages are read as the merge reaches them.
+MergeIterator LSMTree::mergeRange(KEY_t start, KEY_t end, const std::map<KEY_t, VAL_t>& bufferResult, const TreeVersion& version,
+                                  bool openRunsInParallel) {
+    std::vector<std::unique_ptr<MergeCursor>> cursors;
+    auto bufferFirst = bufferResult.lower_bound(start);
+    auto bufferLast = bufferResult.lower_bound(end);
+    cursors.push_back(std::make_unique<MemtableCursor>(bufferFirst, bufferLast));
+
+    // If the buffer holds the entire range, nothing older can change the result
+    size_t rangeKeys = static_cast<size_t>(static_cast<int64_t>(end) - start);
+    bool bufferHoldsRange = bufferResult.size() >= rangeKeys &&
+                            static_cast<size_t>(std::distance(bufferFirst, bufferLast)) == rangeKeys;
+    if (!bufferHoldsRange) {
+        for (const auto& memtable : version.immutableMemtables) {
+            cursors.push_back(std::make_unique<MemtableCursor>(memtable->lowerBound(start), memtable->lowerBound(end)));
+        }
+        std::vector<std::future<std::unique_ptr<MergeCursor>>> futures;
+        for (const auto& level : version.levels) {
+            // The range excludes its end key
+            for (size_t r : level.intervals.findRuns(start, end - 1)) {
+                if (!openRunsInParallel) {
+                    cursors.push_back(std::make_unique<RunCursor>(level.runs[r], start, end));
+                    continue;
+                }
+                futures.push_back(threadPool.enqueue([run = level.runs[r], start, end]() -> std::unique_ptr<MergeCursor> {
+                    return std::make_unique<RunCursor>(run, start, end);
+                }));
+            }
+        }
+        for (auto &future : futures) {
+            cursors.push_back(future.get());
+        }
+    }
+    return MergeIterator(std::move(cursors));
+}
 
+// Estimate the size of the range [start, end) in the runs of a version
+RangeEstimate LSMTree::estimateRuns(KEY_t start, KEY_t end, const TreeVersion& version) {
+    RangeEstimate estimate;
+    for (const auto& level : version.levels) {
+        for (size_t r : level.intervals.findRuns(start, end - 1)) {
+            RangeEstimate runEstimate = level.runs[r]->estimateRange(start, end);
+            estimate.pairs += runEstimate.pairs;
+            estimate.pages += runEstimate.pages;
+            estimate.tombstones += runEstimate.tombstones;
+        }
     }
-    const size_t allPossibleKeys = end - start;
-    size_t keysFound = 0;
-    bool searchLevels = true;
+    return estimate;
+}
 
-    {
-        std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
-        // Search the buffer for the key range and add the found key-value pairs to the priority queue
-        auto bufferResult = buffer.range(start, end);
-        for (const auto &kv : bufferResult) {
-            pq.push(PQEntry{kv.first, kv.second, 0, {}});
-            keysFound++;
-
-            // If the range has the size of the entire range, break the loop
-            if (keysFound == allPossibleKeys) {
-                searchLevels = false;
-                break;
+// Estimate the pairs of the runs overlapping the range [start, end) whose keys no newer run holds. The runs are taken
+// newest first. How many keys of a run the newer runs hide is how much less its key sketch grows the union of the
+// sketches before it than its size. The sketches cover whole runs, so the hidden keys are spread over the run's key
+// range in proportion to the keys the newer runs have there, each newer run assumed to spread its keys evenly over
+// its own key range, and the range gets its share of them. A range where only the run has keys keeps all of its pairs
+// however much the runs overlap elsewhere. Keys count tombstones, while only the pairs that are not tombstones are
+// estimated. A run without a sketch hides nothing and is counted whole.
+double LSMTree::estimateNewestRunPairs(KEY_t start, KEY_t end, const TreeVersion& version) {
+    struct KeySpan {
+        KEY_t first;
+        KEY_t last;
+        size_t keys;
+    };
+    // The keys of a span that lie in [low, high]
+    auto keysWithin = [](const KeySpan& span, int64_t low, int64_t high) {
+        int64_t overlap = std::min<int64_t>(span.last, high) - std::max<int64_t>(span.first, low) + 1;
+        return overlap > 0 ? span.keys * static_cast<double>(overlap) / (int64_t(span.last) - span.first + 1) : 0.0;
+    };
+    KeySketch newerKeys;
+    double newerDistinct = 0;
+    std::vector<KeySpan> newerSpans;
+    double pairs = 0;
+    for (const auto& level : version.levels) {
+        for (size_t r : level.intervals.findRuns(start, end - 1)) {
+            Run& run = *level.runs[r];
+            RangeEstimate runEstimate = run.estimateRange(start, end);
+            auto [firstKey, lastKey] = run.getKeyRange();
+            double visibleShare = 1;
+            if (!run.getKeySketch().empty()) {
+                newerKeys.merge(run.getKeySketch());
+                double distinct = newerKeys.estimate();
+                double hiddenKeys = std::max(0.0, run.getSize() - (distinct - newerDistinct));
+                newerDistinct = std::max(newerDistinct, distinct);
+                size_t rangeKeys = runEstimate.pairs + runEstimate.tombstones;
+                int64_t low = std::max<int64_t>(start, firstKey);
+                int64_t high = std::min<int64_t>(int64_t(end) - 1, lastKey);
+                double newerInRun = 0;
+                double newerInRange = 0;
+                for (const KeySpan& span : newerSpans) {
+                    newerInRun += keysWithin(span, firstKey, lastKey);
+                    newerInRange += keysWithin(span, low, high);
+                }
+                if (newerInRun > 0 && rangeKeys > 0) {
+                    visibleShare = std::max(0.0, 1 - hiddenKeys * (newerInRange / newerInRun) / rangeKeys);
+                }
             }
+            pairs += runEstimate.pairs * visibleShare;
+            newerSpans.push_back({firstKey, lastKey, run.getSize()});
         }
     }
-    if (searchLevels) {
-        std::vector<Level*> localLevelsCopy = getLocalLevelsCopy();
-        std::vector<std::future<std::vector<kvPair>>> futures;
-
-        // Search the levels
-        for (auto level = localLevelsCopy.begin(); level != localLevelsCopy.end(); level++) {
-            // Lock the level with a shared lock
-            std::shared_lock<std::shared_mutex> lock((*level)->levelMutex);
-            futures.reserve((*level)->runs.size());
-
-            for (auto run = (*level)->runs.begin(); run != (*level)->runs.end(); run++) {
-                // Enqueue task for searching in the run
-                futures.push_back(threadPool.enqueue([&, run] {
-                    return (*run)->range(start, end);
-                }));
-            }
+    return pairs;
+}
+
+// Split the range [start, end) into pieces of about as many run pages each, one for every thread that has a core of its
+// own, at the first keys of the pages of the runs it overlaps. Returns the keys that start every piece but the first, or nothing if the range
+// spans too few pages to be worth splitting.
+std::vector<KEY_t> LSMTree::partitionRange(KEY_t start, KEY_t end, const TreeVersion& version) {
+    size_t numPieces = std::min<size_t>(threadPool.getNumThreads(), std::thread::hardware_concurrency());
+    if (numPieces < 2 || estimateRuns(start, end, version).pages < PARALLEL_RANGE_MIN_PAGES) {
+        return {};
+    }
+    std::vector<KEY_t> fenceKeys;
+    for (const auto& level : version.levels) {
+        for (size_t r : level.intervals.findRuns(start, end - 1)) {
+            level.runs[r]->appendFencePointers(start, end, fenceKeys);
+        }
+    }
+    std::sort(fenceKeys.begin(), fenceKeys.end());
+    std::vector<KEY_t> splitKeys;
+    for (size_t piece = 1; piece < numPieces; piece++) {
+        KEY_t key = fenceKeys[piece * fenceKeys.size() / numPieces];
+        if (splitKeys.empty() || splitKeys.back() != key) {
+            splitKeys.push_back(key);
         }
+    }
+    return splitKeys;
+}
 
-        // Wait for all tasks to finish and add the results to the priority queue
-        for (auto &future : futures) {
-            std::vector<kvPair> tempVec = future.get();
-            if (!tempVec.empty()) {
-                for (const auto &kv : tempVec) {
-                    pq.push(PQEntry{kv.key, kv.value, 0, {}});
+// Pass the live pairs of the range [start, end) to the callback, merging the pieces between the split keys on their
+// own. The pieces share no key, so their pairs are passed in order without merging them again. The first piece is
+// merged by the calling thread and passed on as it comes out, while the others are merged ahead on the thread pool,
+// each at most PARALLEL_RANGE_QUEUED_CHUNKS chunks ahead of the caller. The pieces open their run cursors themselves,
+// since a task that waits for other tasks could hold up the pool.
+size_t LSMTree::scanPartitions(KEY_t start, KEY_t end, const std::vector<KEY_t>& splitKeys,
+                               const std::map<KEY_t, VAL_t>& bufferResult, const TreeVersion& version, const RangeCallback& callback) {
+    std::vector<KEY_t> bounds;
+    bounds.push_back(start);
+    bounds.insert(bounds.end(), splitKeys.begin(), splitKeys.end());
+    bounds.push_back(end);
+
+    // Merge a piece into chunks until enough of them wait, it ends or the caller stops
+    auto mergePiece = [](RangePiece& piece) {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(piece.mutex);
+                if (piece.cancelled || piece.chunks.size() >= PARALLEL_RANGE_QUEUED_CHUNKS) {
+                    piece.running = false;
+                    piece.changed.notify_all();
+                    return;
                 }
             }
+            std::vector<kvPair> chunk;
+            chunk.reserve(PARALLEL_RANGE_CHUNK_PAIRS);
+            MergeIterator& it = *piece.merge;
+            for (; it.valid() && chunk.size() < PARALLEL_RANGE_CHUNK_PAIRS; it.next()) {
+                if (it.current().value != TOMBSTONE) {
+                    chunk.push_back(it.current());
+                }
+            }
+            std::lock_guard<std::mutex> lock(piece.mutex);
+            piece.chunks.push_back(std::move(chunk));
+            if (!it.valid()) {
+                piece.done = true;
+                piece.running = false;
+            }
+            piece.changed.notify_all();
+            if (piece.done) {
+                return;
+            }
         }
+    };
+    // Called with the piece's mutex held
+    auto resume = [this, mergePiece](RangePiece& piece) {
+        if (!piece.running && !piece.done && !piece.cancelled) {
+            piece.running = true;
+            threadPool.enqueue([mergePiece, &piece] { mergePiece(piece); });
+        }
+    };
+
+    std::vector<std::unique_ptr<RangePiece>> pieces;
+    for (size_t p = 1; p + 1 < bounds.size(); p++) {
+        pieces.push_back(std::make_unique<RangePiece>());
+        RangePiece& piece = *pieces.back();
+        piece.merge = std::make_unique<MergeIterator>(mergeRange(bounds[p], bounds[p + 1], bufferResult, version, false));
+        std::lock_guard<std::mutex> lock(piece.mutex);
+        resume(piece);
     }
-    // Reset keysFound to 0 since now we're searching everything
-    keysFound = 0;
-    // Merge the sorted key-value pairs using the priority queue
-    while (!pq.empty()) {
-        PQEntry top = pq.top();
-        pq.pop();
-        // Check if the key is the same as the most recent key processed to avoid duplicates
-        if (!mostRecentKey.has_value() || mostRecentKey.value() != top.key) {
-            rangeResult->push_back(kvPair{top.key, top.value});
-            mostRecentKey = top.key; // Update the most recent key processed
-            keysFound++;
-            // If the range has the size of the entire range, break the loop
-            if (keysFound == allPossibleKeys) {
-                break;
+
+    size_t count = 0;
+    bool stopped = false;
+    for (MergeIterator it = mergeRange(bounds[0], bounds[1], bufferResult, version, false); it.valid(); it.next()) {
+        if (it.current().value == TOMBSTONE) {
+            continue;
+        }
+        count++;
+        if (!callback(it.current())) {
+            stopped = true;
+            break;
+        }
+    }
+    for (auto& piece : pieces) {
+        while (!stopped) {
+            std::vector<kvPair> chunk;
+            {
+                std::unique_lock<std::mutex> lock(piece->mutex);
+                piece->changed.wait(lock, [&piece] { return !piece->chunks.empty() || piece->done; });
+                if (piece->chunks.empty()) {
+                    break;
+                }
+                chunk = std::move(piece->chunks.front());
+                piece->chunks.pop_front();
+                resume(*piece);
+            }
+            for (size_t i = 0; i < chunk.size() && !stopped; i++) {
+                count++;
+                stopped = !callback(chunk[i]);
             }
         }
     }
-    // Remove all the TOMBSTONES from the rangeResult
-    removeTombstones(rangeResult);
+    // Every task is waited for, even once the callback has stopped, since they read the caller's buffer range
+    for (auto& piece : pieces) {
+        std::unique_lock<std::mutex> lock(piece->mutex);
+        piece->cancelled = true;
+        piece->changed.wait(lock, [&piece] { return !piece->running; });
+    }
 
     // Update range hits and misses
-    if (rangeResult->empty()) {
-        incrementRangeMisses();
-    } else {
+    if (count > 0) {
         incrementRangeHits();
+    } else {
+        incrementRangeMisses();
     }
-    return rangeResult;
+    return count;
+}
+
+// Take a snapshot of the tree as of the last write. The buffer is copied and the current version pinned while the
+// buffer is locked, so the snapshot is a single point in time. Returns the sequence number that names the snapshot.
+uint64_t LSMTree::createSnapshot() {
+    auto version = std::make_shared<TreeVersion>();
+    uint64_t sequenceNumber;
+    {
+        std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
+        *version = *currentVersion.load();
+        if (buffer.size() > 0) {
+            version->immutableMemtables.insert(version->immutableMemtables.begin(), std::make_shared<const Memtable>(buffer));
+        }
+        sequenceNumber = lastSequenceNumber;
+    }
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    Snapshot &snapshot = snapshots[sequenceNumber];
+    if (snapshot.version == nullptr) {
+        snapshot.version = std::move(version);
+    }
+    snapshot.handles++;
+    return sequenceNumber;
+}
+
+// Release one handle of a snapshot. Once its last handle is released, the runs only it was using are deleted.
+// Returns false if there is no such snapshot.
+bool LSMTree::releaseSnapshot(uint64_t sequenceNumber) {
+    std::shared_ptr<const TreeVersion> version; // Released after the lock, since dropping it may delete run files
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    auto it = snapshots.find(sequenceNumber);
+    if (it == snapshots.end()) {
+        return false;
+    }
+    if (--it->second.handles == 0) {
+        version = std::move(it->second.version);
+        snapshots.erase(it);
+    }
+    return true;
+}
+
+// Return the version of a live snapshot, or nullptr if there is no such snapshot. The caller's reference keeps the
+// version readable even if the snapshot is released meanwhile.
+std::shared_ptr<const TreeVersion> LSMTree::getSnapshot(uint64_t sequenceNumber) {
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    auto it = snapshots.find(sequenceNumber);
+    return (it == snapshots.end()) ? nullptr : it->second.version;
 }
 
 // Given a key, delete the key-value pair from the tree.
@@ -450,12 +1229,20 @@ void LSMTree::benchmark(const std::string& filename, bool verbose, size_t verbos
     auto start_time = std::chrono::high_resolution_clock::now();
     SyncedCout() << "Benchmark: loaded \"" << filename << "\"" << std::endl;
 
+    // Consecutive gets are collected and looked up together
+    std::vector<KEY_t> pendingGets;
+    pendingGets.reserve(GET_BATCH_SIZE);
+
     std::string line;
     while (std::getline(ss, line)) {
         std::stringstream line_ss(line);
         char command_code;
         line_ss >> command_code;
 
+        if (command_code != 'g' && !pendingGets.empty()) {
+            multiGet(pendingGets);
+            pendingGets.clear();
+        }
         switch (command_code) {
             case 'p': {
                 KEY_t key;
@@ -473,7 +1260,11 @@ void LSMTree::benchmark(const std::string& filename, bool verbose, size_t verbos
             case 'g': {
                 KEY_t key;
                 line_ss >> key;
-                get(key);
+                pendingGets.push_back(key);
+                if (pendingGets.size() == GET_BATCH_SIZE) {
+                    multiGet(pendingGets);
+                    pendingGets.clear();
+                }
                 break;
             }
             case 'r': {
@@ -499,6 +1290,9 @@ void LSMTree::benchmark(const std::string& filename, bool verbose, size_t verbos
             }
         }
     }
+    if (!pendingGets.empty()) {
+        multiGet(pendingGets);
+    }
 
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
@@ -541,7 +1335,7 @@ bool LSMTree::isLastLevel(std::vector<std::shared_ptr<Level>>::iterator it) {
 }
 // Check if a level number is the last level
 bool LSMTree::isLastLevel(unsigned int levelNum) {
-    return (levelNum == levels.size() - 1);
+    return (levelNum == levels.size());
 }
 
 // Set the number of logical pairs in the tree by creating a set of all the keys in the tree
@@ -614,6 +1408,23 @@ void LSMTree::printHitsMissesStats() {
     SyncedCout() << "getMisses: " << getGetMisses() << std::endl;
     SyncedCout() << "rangeHits: " << getRangeHits() << std::endl;
     SyncedCout() << "rangeMisses: " << getRangeMisses() << std::endl;
+    if (rowCache->getCapacity() > 0) {
+        size_t cacheHits = rowCache->getHits();
+        size_t cacheLookups = cacheHits + rowCache->getMisses();
+        double hitRate = cacheLookups > 0 ? 100.0 * cacheHits / cacheLookups : 0;
+        SyncedCout() << "rowCacheHits: " << cacheHits << std::endl;
+        SyncedCout() << "rowCacheMisses: " << rowCache->getMisses() << std::endl;
+        SyncedCout() << "rowCacheHitRate: " << std::fixed << std::setprecision(2) << hitRate << "%" << std::endl;
+        SyncedCout() << "rowCacheRejections: " << rowCache->getRejections() << std::endl;
+    }
+    if (blockCache->getCapacity() > 0) {
+        SyncedCout() << "blockCacheUsage: " << addCommas(std::to_string(blockCache->getUsage())) << " of "
+                     << addCommas(std::to_string(blockCache->getCapacity())) << " bytes" << std::endl;
+        SyncedCout() << "blockCacheDataHits: " << blockCache->getHits(BlockCache::Kind::DATA) << std::endl;
+        SyncedCout() << "blockCacheDataMisses: " << blockCache->getMisses(BlockCache::Kind::DATA) << std::endl;
+        SyncedCout() << "blockCacheFilterHits: " << blockCache->getHits(BlockCache::Kind::FILTER) << std::endl;
+        SyncedCout() << "blockCacheFilterMisses: " << blockCache->getMisses(BlockCache::Kind::FILTER) << std::endl;
+    }
 }
 
 // Print out a summary of the tree.
@@ -702,7 +1513,19 @@ std::string LSMTree::printInfo() {
     output << "Number of entries in the buffer: " << addCommas(std::to_string(bufferContents.size()))
            << " (Max " << addCommas(std::to_string(buffer.getMaxKvPairs())) << " entries, or "
            << addCommas(std::to_string(buffer.getMaxKvPairs() * sizeof(kvPair))) << " bytes, "
-           << std::to_string(static_cast<int>(percentage)) << "% full)\n\n";
+           << std::to_string(static_cast<int>(percentage)) << "% full)\n";
+    {
+        std::shared_lock<std::shared_mutex> bufferLock(bufferMutex);
+        output << "Last sequence number: " << addCommas(std::to_string(lastSequenceNumber));
+    }
+    {
+        std::lock_guard<std::mutex> lock(snapshotsMutex);
+        output << ", live snapshots: " << snapshots.size();
+        if (!snapshots.empty()) {
+            output << " (oldest at " << addCommas(std::to_string(snapshots.begin()->first)) << ")";
+        }
+    }
+    output << "\n\n";
 
     output << "Number of Levels: " + std::to_string(localLevelsCopy.size()) + "\n\n";
 
@@ -739,6 +1562,53 @@ std::string LSMTree::printInfo() {
                          << "is it the last level? " << ((i + 1 == localLevelsCopy.size()) ? "Yes" : "No") << "\n";
     }
     output << levelDiskSummary.str();
+    output << printLevelIndexStats(localLevelsCopy);
+    return output.str();
+}
+
+// For each level, the memory of the runs' fence pointers and learned indexes, and the reads and entries fetched per
+// search of a run file, so the two ways of locating a key in a run can be compared
+std::string LSMTree::printLevelIndexStats(const std::vector<Level*>& localLevelsCopy) {
+    std::vector<LevelGetStats> localGetStats = getLevelGetStats();
+    std::vector<std::string> levelStrings, fenceStrings, learnedStrings, segmentStrings, searchStrings;
+    for (size_t i = 0; i < localLevelsCopy.size(); i++) {
+        size_t fenceBytes = 0, learnedBytes = 0, segments = 0;
+        {
+            std::shared_lock<std::shared_mutex> levelLock(localLevelsCopy[i]->levelMutex);
+            for (const auto &run : localLevelsCopy[i]->runs) {
+                fenceBytes += run->getFenceIndexBytes();
+                learnedBytes += run->getLearnedIndexBytes();
+                segments += run->getLearnedIndexSegments();
+            }
+        }
+        levelStrings.push_back(std::to_string(localLevelsCopy[i]->getLevelNum()));
+        fenceStrings.push_back(addCommas(std::to_string(fenceBytes)));
+        learnedStrings.push_back(addCommas(std::to_string(learnedBytes)));
+        segmentStrings.push_back(addCommas(std::to_string(segments)));
+        searchStrings.push_back(addCommas(std::to_string(i < localGetStats.size() ? localGetStats[i].searches : 0)));
+    }
+    const int levelWidth = getLongestStringLength(levelStrings) + 1;
+    const int fenceWidth = getLongestStringLength(fenceStrings);
+    const int learnedWidth = getLongestStringLength(learnedStrings);
+    const int segmentWidth = getLongestStringLength(segmentStrings);
+    const int searchWidth = getLongestStringLength(searchStrings) + 2;
+
+    std::stringstream output;
+    output << std::right << std::fixed << std::setprecision(2);
+    output << "\nRun index per level (learned index "
+           << (learnedIndexEpsilon == 0 ? "disabled" : "epsilon " + std::to_string(learnedIndexEpsilon)) << "):\n";
+    for (size_t i = 0; i < levelStrings.size(); i++) {
+        size_t searches = (i < localGetStats.size()) ? localGetStats[i].searches : 0;
+        double readsPerSearch = searches == 0 ? 0 : static_cast<double>(localGetStats[i].searchReads) / searches;
+        double entriesPerSearch = searches == 0 ? 0 : static_cast<double>(localGetStats[i].searchEntries) / searches;
+        output << "Level" << std::setw(levelWidth) << levelStrings[i]
+               << " fence pointers: " << std::setw(fenceWidth) << fenceStrings[i] << " bytes, "
+               << "learned index: " << std::setw(learnedWidth) << learnedStrings[i] << " bytes ("
+               << std::setw(segmentWidth) << segmentStrings[i] << " segments), "
+               << "searches: " << std::setw(searchWidth) << searchStrings[i] + ", "
+               << "reads per search: " << readsPerSearch << ", "
+               << "entries read per search: " << entriesPerSearch << "\n";
+    }
     return output.str();
 }
 
@@ -799,6 +1669,41 @@ std::string LSMTree::printLevelIoCount() {
     output << penaltyOutput.str();
     output << "\nTotal time with penalties: " << addCommas(std::to_string(totalPenaltyTime)) 
            << " microseconds (" << formatMicroseconds(totalPenaltyTime) << ")\n";
+    output << printLevelGetStats();
+    return output.str();
+}
+
+// For each level, the measured Bloom filter FPR (false positives over all probes for keys not in the run) and the
+// page reads per get, so a tree optimized for hits can be compared against one with filters on every level
+std::string LSMTree::printLevelGetStats() {
+    std::stringstream output;
+    std::vector<LevelGetStats> localGetStats = getLevelGetStats();
+    size_t totalGets = getGetHits() + getGetMisses();
+    std::vector<std::string> levelStrings, fprStrings, ioStrings, ioPerGetStrings;
+    size_t totalIo = 0;
+    for (size_t i = 0; i < localGetStats.size(); i++) {
+        const LevelGetStats &stats = localGetStats[i];
+        size_t negativeProbes = stats.negatives + stats.falsePositives;
+        size_t io = stats.falsePositives + stats.truePositives;
+        totalIo += io;
+        levelStrings.push_back(std::to_string(i + 1));
+        fprStrings.push_back(negativeProbes == 0 ? "Unused" : std::to_string(static_cast<double>(stats.falsePositives) / negativeProbes));
+        ioStrings.push_back(addCommas(std::to_string(io)));
+        ioPerGetStrings.push_back(totalGets == 0 ? "0" : std::to_string(static_cast<double>(io) / totalGets));
+    }
+    const int levelWidth = getLongestStringLength(levelStrings) + 1;
+    const int fprWidth = getLongestStringLength(fprStrings) + 2;
+    const int ioWidth = getLongestStringLength(ioStrings) + 2;
+
+    output << "\nGet I/O per level (" << (optimizeForHits ? "optimized for hits" : "filters on all levels") << "):\n";
+    output << std::right;
+    for (size_t i = 0; i < localGetStats.size(); i++) {
+        output << "Level" << std::setw(levelWidth) << levelStrings[i]
+               << " measured FPR: " << std::setw(fprWidth) << fprStrings[i] + ", "
+               << "Get I/O count: " << std::setw(ioWidth) << ioStrings[i] + ", "
+               << "I/O per get: " << ioPerGetStrings[i] << "\n";
+    }
+    output << "Total I/O per get: " << (totalGets == 0 ? "0" : std::to_string(static_cast<double>(totalIo) / totalGets)) << "\n";
     return output.str();
 }
 
@@ -814,18 +1719,37 @@ std::string LSMTree::getBloomFilterSummary() {
     std::string bfStatus = getBfFalsePositiveRate() == BLOOM_FILTER_UNUSED ? "Unused" : std::to_string(getBfFalsePositiveRate());
     output << "\nBloom filter total measured FPR: " << bfStatus << "\n";
 
+    std::stringstream memory;
+    memory << std::fixed << std::setprecision(2) << getTotalBits() / 8.0 / (1024 * 1024) << " MB";
+    if (filterMemoryBudgetBits > 0) {
+        memory << " of " << getFilterMemoryBudgetMB() << " MB budget ("
+               << static_cast<int>(100.0 * getTotalBits() / filterMemoryBudgetBits) << "% used)";
+    } else {
+        memory << " (no budget)";
+    }
+    output << "Bloom filter memory: " << memory.str() << "\n";
+
     std::vector<std::vector<std::map<std::string, std::string>>> summaries(localLevelsCopy.size());
+    size_t partitionBits = 0;
+    size_t partitionIndexBytes = 0;
     for (size_t i = 0; i < localLevelsCopy.size(); i++) {
         std::shared_lock<std::shared_mutex> levelLock(localLevelsCopy[i]->levelMutex);
         for (size_t j = 0; j < localLevelsCopy[i]->runs.size(); j++) {
             summaries[i].push_back(localLevelsCopy[i]->runs[j]->getBloomFilterSummary());
+            partitionBits += localLevelsCopy[i]->runs[j]->getPartitionedFilter().getNumBits();
+            partitionIndexBytes += localLevelsCopy[i]->runs[j]->getPartitionedFilter().getIndexBytes();
         }
     }
+    if (partitionBits > 0) {
+        output << "Partitioned filters: " << std::fixed << std::setprecision(2) << partitionBits / 8.0 / (1024 * 1024)
+               << " MB on disk, " << addCommas(std::to_string(partitionIndexBytes)) << " bytes of partition index in memory\n";
+    }
 
     // Set the width for each field/column. Additional + 2 is for commas and spaces.
     const int runWidth = std::to_string(getLongestVectorLength(summaries)).length();
     const int bloomSizeWidth = getLongestStringLength(getMapValuesByKey(summaries, "bloomFilterSize")) + 2;
     const int numHashFunctionsWidth = getLongestStringLength(getMapValuesByKey(summaries, "hashFunctions")) + 2;
+    const int unitsWidth = getLongestStringLength(getMapValuesByKey(summaries, "units")) + 2;
     const int keysWidth = getLongestStringLength(getMapValuesByKey(summaries, "keys")) + 2;
     const int fprWidth = getLongestStringLength(getMapValuesByKey(summaries, "theoreticalFPR")) + 2;
     const int tpfpWidth = getLongestStringLength(getMapValuesByKey(summaries, "truePositives")) + 2;
@@ -836,6 +1760,7 @@ std::string LSMTree::getBloomFilterSummary() {
             output << "Run " << std::setw(runWidth) << j << ": ";
             output << "Bloom Filter Size: " << std::setw(bloomSizeWidth) << summaries[i][j]["bloomFilterSize"] + ", "
             << "Hash Functions: " << std::setw(numHashFunctionsWidth) << summaries[i][j]["hashFunctions"] + ", "
+            << "Units: " << std::setw(unitsWidth) << summaries[i][j]["units"] + ", "
             << "Number of Keys: " << std::setw(keysWidth) << summaries[i][j]["keys"] + ", "
             << "Theoretical FPR: " << std::setw(fprWidth) << summaries[i][j]["theoreticalFPR"] + ", "
             << "TP: " << std::setw(tpfpWidth) << summaries[i][j]["truePositives"] + ", "
@@ -849,11 +1774,10 @@ std::string LSMTree::getBloomFilterSummary() {
 }
 
 float LSMTree::getBfFalsePositiveRate() {
-    std::shared_lock<std::shared_mutex> lockF(bfFalsePositivesMutex);
-    std::shared_lock<std::shared_mutex> lockT(bfTruePositivesMutex);
-    size_t total = bfFalsePositives + bfTruePositives;
+    size_t falsePositives = bfFalsePositives.load(std::memory_order_relaxed);
+    size_t total = falsePositives + bfTruePositives.load(std::memory_order_relaxed);
     if (total > 0) {
-        return (float)bfFalsePositives / total;
+        return (float)falsePositives / total;
     } else {
         return BLOOM_FILTER_UNUSED; // No false positives or true positives
     }
@@ -864,7 +1788,7 @@ size_t LSMTree::getTotalBits() const {
     size_t totalBits = 0;
     for (auto it = levels.begin(); it != levels.end(); it++) {
         totalBits += std::accumulate((*it)->runs.begin(), (*it)->runs.end(), size_t(0),
-            [](size_t sum, const std::unique_ptr<Run>& run) {
+            [](size_t sum, const std::shared_ptr<Run>& run) {
                 return sum + run->getBloomFilterNumBits();
             });
     }
@@ -898,16 +1822,23 @@ double LSMTree::eval(size_t bits, size_t entries) const {
 double LSMTree::AutotuneFilters(size_t mFilters) {
     size_t delta = mFilters;
 
-    // Flatten the tree structure into a single runs vector and zero out all the bits
+    // Flatten the tree structure into a single runs vector and zero out all the bits. Runs with partitioned filters
+    // keep no filter in memory, so they take no part.
     std::vector<Run*> allRuns;
     for (const auto& level : levels) {
         for (auto& runPtr : level->runs) {
+            if (runPtr->hasPartitionedFilter()) {
+                continue;
+            }
             runPtr->setBloomFilterNumBits(0);
             allRuns.push_back(runPtr.get());
         }
     }
-    levels.front()->runs.front()->setBloomFilterNumBits(mFilters);
-    double R = allRuns.size() - 1 + eval(levels.front()->runs.front()->getBloomFilterNumBits(), levels.front()->runs.front()->getSize());
+    if (allRuns.empty()) {
+        return 0;
+    }
+    allRuns.front()->setBloomFilterNumBits(mFilters);
+    double R = allRuns.size() - 1 + eval(allRuns.front()->getBloomFilterNumBits(), allRuns.front()->getSize());
 
     while (delta >= 1) {
         double rNew = R;
@@ -929,20 +1860,252 @@ double LSMTree::AutotuneFilters(size_t mFilters) {
 }
 
 void LSMTree::monkeyOptimizeBloomFilters() {
+    std::unique_lock<std::mutex> tuningLock(bloomFilterTuningMutex);
     size_t totalBits = getTotalBits();
     SyncedCout() << "Total bits: " << totalBits << std::endl;
     double R = AutotuneFilters(totalBits);
     SyncedCout() << "Total cost R: " << R << std::endl;
     for (auto it = levels.begin(); it != levels.end(); it++) {
         for (auto run = (*it)->runs.begin(); run != (*it)->runs.end(); run++) {
-            (*run)->resizeBloomFilterBitset((*run)->getBloomFilterNumBits());
-            (*run)->populateBloomFilter();
+            if (!(*run)->hasPartitionedFilter()) {
+                (*run)->rebuildBloomFilter((*run)->getBloomFilterNumBits());
+            }
         }
     }
     SyncedCout() << "\nNew Bloom Filter summaries:" << std::endl;
     SyncedCout() << getBloomFilterSummary() << std::endl;
 }
 
+// Return the error rate for a new run's Bloom filter. Without a memory budget this is the configured error rate.
+// With a budget, MONKEY's optimal allocation gives every run an error rate proportional to its number of entries,
+// so new runs are built at the size the current allocation would give them. When optimizing for hits, runs on the
+// last level get an error rate of 1, i.e. no filter at all.
+double LSMTree::getBloomFilterErrorRate(size_t numEntries, int levelNum) {
+    if (optimizeForHits && static_cast<size_t>(levelNum) == levels.size()) {
+        return 1.0;
+    }
+    std::shared_lock<std::shared_mutex> lock(filterBudgetLambdaMutex);
+    if (filterBudgetLambda == 0) {
+        return bfErrorRate;
+    }
+    return std::clamp(filterBudgetLambda * numEntries, BLOOM_FILTER_MIN_ERROR_RATE, 1.0);
+}
+
+// Redistribute the filter memory budget over all runs. Minimizing the sum of false positive rates for a fixed number
+// of bits gives each run an error rate of lambda * entries (capped at 1, i.e. no filter), so lambda is found by a
+// binary search on the total bits. When optimizing for hits, the last level's filters are dropped and, without an
+// explicit budget, the memory they would have used at the configured error rate goes to the upper levels instead.
+// Partitioned filters are on disk, so their runs are left out. Only lambda is published here, which new runs use right
+// away; the tuner thread resizes the filters of the existing runs, so the flush does not wait for their rebuilds.
+// Precondition: the first level is exclusively locked, so no run is added or removed.
+void LSMTree::updateFilterBudgetLambda() {
+    if (filterMemoryBudgetBits == 0 && !optimizeForHits) {
+        return;
+    }
+    const double ln2Squared = std::log(2) * std::log(2);
+    std::vector<Run*> allRuns;
+    double budget = filterMemoryBudgetBits;
+    for (const auto& level : levels) {
+        bool dropFilters = optimizeForHits && level == levels.back();
+        for (auto& runPtr : level->runs) {
+            if (runPtr->getSize() == 0 || runPtr->hasPartitionedFilter()) {
+                continue;
+            }
+            if (filterMemoryBudgetBits == 0) {
+                budget += -static_cast<double>(runPtr->getMaxKvPairs()) * std::log(bfErrorRate) / ln2Squared;
+            }
+            if (!dropFilters) {
+                allRuns.push_back(runPtr.get());
+            }
+        }
+    }
+    if (!allRuns.empty()) {
+        auto totalBitsFor = [&](double lambda) {
+            return std::accumulate(allRuns.begin(), allRuns.end(), 0.0, [&](double sum, Run* run) {
+                return sum + budgetFilterBits(lambda, run->getMaxKvPairs());
+            });
+        };
+        // Search lambda in log space between the smallest and largest sensible values
+        double low = std::log(BLOOM_FILTER_MIN_ERROR_RATE);
+        double high = 0;
+        for (int i = 0; i < 64; i++) {
+            double mid = (low + high) / 2;
+            if (totalBitsFor(std::exp(mid) / allRuns.front()->getMaxKvPairs()) > budget) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(filterBudgetLambdaMutex);
+        filterBudgetLambda = std::exp(high) / allRuns.front()->getMaxKvPairs();
+    }
+    {
+        std::lock_guard<std::mutex> lock(bloomFilterTunerMutex);
+        filterBudgetResizePending = true;
+    }
+    bloomFilterTunerCv.notify_all();
+}
+
+// Rebuild the filters of the runs whose size is off by more than FILTER_BUDGET_REBUILD_TOLERANCE from what the current
+// lambda gives them, and drop the filters of the last level when optimizing for hits. The runs are picked under the
+// level locks, which are released before the rebuilds, so writers are not held up by them. A run compacted away
+// meanwhile stays readable through its shared pointer, and readers switch to a rebuilt filter atomically.
+void LSMTree::resizeFiltersToBudget() {
+    std::vector<std::pair<std::shared_ptr<Run>, size_t>> rebuilds;
+    {
+        std::vector<Level*> localLevelsCopy = getLocalLevelsCopy();
+        std::vector<std::shared_lock<std::shared_mutex>> levelLocks;
+        levelLocks.reserve(localLevelsCopy.size());
+        for (auto level : localLevelsCopy) {
+            levelLocks.emplace_back(level->levelMutex);
+        }
+        double lambda;
+        {
+            std::shared_lock<std::shared_mutex> lock(filterBudgetLambdaMutex);
+            lambda = filterBudgetLambda;
+        }
+        for (auto level : localLevelsCopy) {
+            bool dropFilters = optimizeForHits && level == localLevelsCopy.back();
+            for (auto& run : level->runs) {
+                if (run->getSize() == 0 || run->hasPartitionedFilter()) {
+                    continue;
+                }
+                size_t currentUnitBits = run->getBloomFilterUnitBits();
+                if (dropFilters) {
+                    if (currentUnitBits > 0) {
+                        rebuilds.emplace_back(run, 0);
+                    }
+                    continue;
+                }
+                if (lambda == 0) {
+                    continue;
+                }
+                // The allocation is made for the units a new run starts with, so the tuner can still move units around
+                size_t targetUnitBits = budgetFilterBits(lambda, run->getMaxKvPairs()) / DEFAULT_BLOOM_FILTER_RESIDENT_UNITS;
+                if (std::abs(static_cast<double>(targetUnitBits) - static_cast<double>(currentUnitBits)) > FILTER_BUDGET_REBUILD_TOLERANCE * currentUnitBits) {
+                    rebuilds.emplace_back(run, targetUnitBits * run->getBloomFilterEnabledUnits());
+                }
+            }
+        }
+    }
+    std::unique_lock<std::mutex> tuningLock(bloomFilterTuningMutex);
+    for (auto& [run, numBits] : rebuilds) {
+        run->rebuildBloomFilter(numBits);
+    }
+}
+
+// Start retuning the elastic Bloom filter units in the background. Called once the saved state is deserialized, since
+// deserialize replaces the levels the tuner walks.
+void LSMTree::startBloomFilterTuner() {
+    bloomFilterTunerThread = std::thread(&LSMTree::bloomFilterTunerLoop, this);
+}
+
+// Wake up every BLOOM_TUNER_INTERVAL_MS and retune the elastic Bloom filter units until the tree is destroyed. A flush
+// that changes the filter memory budget's lambda wakes the tuner early to resize the filters of the existing runs.
+void LSMTree::bloomFilterTunerLoop() {
+    std::unique_lock<std::mutex> lock(bloomFilterTunerMutex);
+    auto nextTuning = std::chrono::steady_clock::now() + std::chrono::milliseconds(BLOOM_TUNER_INTERVAL_MS);
+    while (true) {
+        bloomFilterTunerCv.wait_until(lock, nextTuning, [this] { return stopBloomFilterTuner || filterBudgetResizePending; });
+        if (stopBloomFilterTuner) {
+            break;
+        }
+        bool resize = std::exchange(filterBudgetResizePending, false);
+        lock.unlock();
+        if (resize) {
+            resizeFiltersToBudget();
+        }
+        if (std::chrono::steady_clock::now() >= nextTuning) {
+            tuneBloomFilterUnits();
+            nextTuning = std::chrono::steady_clock::now() + std::chrono::milliseconds(BLOOM_TUNER_INTERVAL_MS);
+        }
+        lock.lock();
+    }
+}
+
+// Redistribute the enabled Bloom filter units across all runs according to how often each run's filter is probed.
+// Every run keeps at least BLOOM_FILTER_MIN_UNITS, and the remaining units go to the runs where they remove the most
+// expected false positives per bit, so the total resident filter memory never grows.
+void LSMTree::tuneBloomFilterUnits() {
+    std::vector<Level*> localLevelsCopy = getLocalLevelsCopy();
+    std::vector<std::shared_lock<std::shared_mutex>> levelLocks;
+    levelLocks.reserve(localLevelsCopy.size());
+    for (auto level : localLevelsCopy) {
+        levelLocks.emplace_back(level->levelMutex);
+    }
+    // Level locks are always taken before the tuning lock, never the other way around
+    std::unique_lock<std::mutex> tuningLock(bloomFilterTuningMutex);
+
+    struct UnitAllocation {
+        Run* run;
+        double frequency;
+        size_t units;
+    };
+    std::vector<UnitAllocation> allocations;
+    double totalFrequency = 0;
+    size_t budget = 0;
+    size_t used = 0;
+
+    for (auto level : localLevelsCopy) {
+        for (auto &run : level->runs) {
+            if (run->getSize() == 0 || run->getBloomFilterUnitBits() == 0) {
+                continue;
+            }
+            double frequency = run->updateAccessFrequency();
+            totalFrequency += frequency;
+            if (filterMemoryBudgetBits == 0) {
+                budget += run->getBloomFilterEnabledUnits() * run->getBloomFilterUnitBits();
+            }
+            used += BLOOM_FILTER_MIN_UNITS * run->getBloomFilterUnitBits();
+            allocations.push_back({run.get(), frequency, BLOOM_FILTER_MIN_UNITS});
+        }
+    }
+    if (filterMemoryBudgetBits > 0) {
+        budget = filterMemoryBudgetBits;
+    }
+    // Nothing has been probed recently, so there is nothing to go by
+    if (totalFrequency == 0 || used > budget) {
+        return;
+    }
+
+    // The expected false positives removed per bit by enabling one more unit on a run
+    auto gain = [](const UnitAllocation &a) {
+        double unitFpr = a.run->getBloomFilterUnitErrorRate();
+        return a.frequency * (std::pow(unitFpr, a.units) - std::pow(unitFpr, a.units + 1)) / a.run->getBloomFilterUnitBits();
+    };
+    std::priority_queue<std::pair<double, size_t>> pq;
+    for (size_t i = 0; i < allocations.size(); i++) {
+        if (allocations[i].units < allocations[i].run->getBloomFilterNumUnits()) {
+            pq.push({gain(allocations[i]), i});
+        }
+    }
+    while (!pq.empty()) {
+        UnitAllocation &a = allocations[pq.top().second];
+        pq.pop();
+        size_t unitBits = a.run->getBloomFilterUnitBits();
+        if (used + unitBits > budget) {
+            continue;
+        }
+        a.units++;
+        used += unitBits;
+        if (a.units < a.run->getBloomFilterNumUnits()) {
+            pq.push({gain(a), static_cast<size_t>(&a - allocations.data())});
+        }
+    }
+
+    // Disable units before enabling others so the resident filter memory stays within the budget
+    for (const auto &a : allocations) {
+        if (a.units < a.run->getBloomFilterEnabledUnits()) {
+            a.run->setBloomFilterEnabledUnits(a.units);
+        }
+    }
+    for (const auto &a : allocations) {
+        if (a.units > a.run->getBloomFilterEnabledUnits()) {
+            a.run->setBloomFilterEnabledUnits(a.units);
+        }
+    }
+}
+
 size_t LSMTree::getLevelIoCount(int levelNum) {
     std::shared_lock<std::shared_mutex> lock(levelIoCountAndTimeMutex);
     return levelIoCountAndTime[levelNum-1].first;
@@ -968,32 +2131,72 @@ size_t LSMTree::getIoCount() {
     return ioCount;
 }
 
-void LSMTree::incrementBfFalsePositives() { 
-    std::unique_lock<std::shared_mutex> lock(bfFalsePositivesMutex);
-    bfFalsePositives++;
+void LSMTree::incrementBfFalsePositives(int levelNum) { 
+    bfFalsePositives.fetch_add(1, std::memory_order_relaxed);
+    getLevelGetCounters(levelNum).falsePositives.fetch_add(1, std::memory_order_relaxed);
+}
+void LSMTree::incrementBfTruePositives(int levelNum) {
+    bfTruePositives.fetch_add(1, std::memory_order_relaxed);
+    getLevelGetCounters(levelNum).truePositives.fetch_add(1, std::memory_order_relaxed);
+}
+void LSMTree::incrementBfNegatives(int levelNum) {
+    getLevelGetCounters(levelNum).negatives.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Record a search of a run file for a key, made of reads that fetched entries key-value pairs in total
+void LSMTree::recordRunSearch(int levelNum, size_t reads, size_t entries) {
+    LevelGetCounters &counters = getLevelGetCounters(levelNum);
+    counters.searches.fetch_add(1, std::memory_order_relaxed);
+    counters.searchReads.fetch_add(reads, std::memory_order_relaxed);
+    counters.searchEntries.fetch_add(entries, std::memory_order_relaxed);
+}
+
+LSMTree::LevelGetCounters& LSMTree::getLevelGetCounters(int levelNum) {
+    return levelGetCounters[std::min<size_t>(levelNum, MAX_LEVEL_GET_STATS) - 1];
 }
-void LSMTree::incrementBfTruePositives() {
-    std::unique_lock<std::shared_mutex> lock(bfTruePositivesMutex);
-    bfTruePositives++; 
+
+// Return the get statistics of every level of the tree
+std::vector<LSMTree::LevelGetStats> LSMTree::getLevelGetStats() const {
+    size_t numLevels;
+    {
+        std::shared_lock<std::shared_mutex> lock(levelIoCountAndTimeMutex);
+        numLevels = std::min(levelIoCountAndTime.size(), MAX_LEVEL_GET_STATS);
+    }
+    std::vector<LevelGetStats> stats;
+    for (size_t i = 0; i < numLevels; i++) {
+        stats.push_back(levelGetCounters[i].load());
+    }
+    return stats;
+}
+
+LSMTree::LevelGetStats LSMTree::LevelGetCounters::load() const {
+    return {negatives.load(std::memory_order_relaxed), falsePositives.load(std::memory_order_relaxed),
+            truePositives.load(std::memory_order_relaxed), searches.load(std::memory_order_relaxed),
+            searchReads.load(std::memory_order_relaxed), searchEntries.load(std::memory_order_relaxed)};
+}
+
+void LSMTree::LevelGetCounters::store(const LevelGetStats& stats) {
+    negatives = stats.negatives;
+    falsePositives = stats.falsePositives;
+    truePositives = stats.truePositives;
+    searches = stats.searches;
+    searchReads = stats.searchReads;
+    searchEntries = stats.searchEntries;
 }
 
 void LSMTree::incrementGetHits() { 
-    std::unique_lock<std::shared_mutex> lock(getHitsMutex);
-    getHits++;
+    getHits.fetch_add(1, std::memory_order_relaxed);
 }
 
 void LSMTree::incrementGetMisses() { 
-    std::unique_lock<std::shared_mutex> lock(getMissesMutex);
-    getMisses++;
+    getMisses.fetch_add(1, std::memory_order_relaxed);
 }
 
 void LSMTree::incrementRangeMisses() { 
-    std::unique_lock<std::shared_mutex> lock(rangeMissesMutex);
-    rangeMisses++;
+    rangeMisses.fetch_add(1, std::memory_order_relaxed);
 }
 void LSMTree::incrementRangeHits() { 
-    std::unique_lock<std::shared_mutex> lock(rangeHitsMutex);
-    rangeHits++;
+    rangeHits.fetch_add(1, std::memory_order_relaxed);
 }
 
 size_t LSMTree::getCompactionPlanSize() {
@@ -1007,20 +2210,16 @@ void LSMTree::clearCompactionPlan() {
 }
 
 size_t LSMTree::getGetHits() const { 
-    std::shared_lock<std::shared_mutex> lock(getHitsMutex);
-    return getHits;
+    return getHits.load(std::memory_order_relaxed);
 }
 size_t LSMTree::getGetMisses() const { 
-    std::shared_lock<std::shared_mutex> lock(getMissesMutex);
-    return getMisses;
+    return getMisses.load(std::memory_order_relaxed);
 }
 size_t LSMTree::getRangeHits() const { 
-    std::shared_lock<std::shared_mutex> lock(rangeHitsMutex);
-    return rangeHits;
+    return rangeHits.load(std::memory_order_relaxed);
 }
 size_t LSMTree::getRangeMisses() const { 
-    std::shared_lock<std::shared_mutex> lock(rangeMissesMutex);
-    return rangeMisses;
+    return rangeMisses.load(std::memory_order_relaxed);
 }
 
 json LSMTree::serialize() const {
@@ -1031,14 +2230,28 @@ json LSMTree::serialize() const {
     j["compactionPercentage"] = compactionPercentage;
     j["levelPolicy"] = Level::policyToString(levelPolicy);
     j["levels"] = json::array();
-    j["bfFalsePositives"] = bfFalsePositives;
-    j["bfTruePositives"] = bfTruePositives;
-    j["getMisses"] = getMisses;
-    j["getHits"] = getHits;
-    j["rangeMisses"] = rangeMisses;
-    j["rangeHits"] = rangeHits;
+    j["bfFalsePositives"] = bfFalsePositives.load();
+    j["bfTruePositives"] = bfTruePositives.load();
+    j["getMisses"] = getMisses.load();
+    j["getHits"] = getHits.load();
+    j["rangeMisses"] = rangeMisses.load();
+    j["rangeHits"] = rangeHits.load();
     j["levelIoCountAndTime"] = json::array();
     j["commandCounter"] = commandCounter.load();
+    j["filterMemoryBudgetBits"] = filterMemoryBudgetBits;
+    j["optimizeForHits"] = optimizeForHits;
+    j["rowCacheCapacity"] = rowCache->getCapacity();
+    j["parallelGets"] = parallelGets;
+    j["learnedIndexEpsilon"] = learnedIndexEpsilon;
+    j["blockHashIndex"] = blockHashIndex;
+    j["blockCacheCapacity"] = blockCache->getCapacity();
+    j["partitionedFilters"] = partitionedFilters;
+    j["lastSequenceNumber"] = lastSequenceNumber;
+    j["levelGetStats"] = json::array();
+    for (const auto& stats : getLevelGetStats()) {
+        j["levelGetStats"].push_back({stats.negatives, stats.falsePositives, stats.truePositives,
+                                      stats.searches, stats.searchReads, stats.searchEntries});
+    }
 
     for (const auto& lvlIo : levelIoCountAndTime) {
         j["levelIoCountAndTime"].push_back(lvlIo.first);
@@ -1073,6 +2286,7 @@ void LSMTree::deserialize(const std::string& filename) {
 
     json treeJson;
     infile >> treeJson;
+    std::unique_lock<std::mutex> tuningLock(bloomFilterTuningMutex);
 
     bfErrorRate = treeJson["bfErrorRate"].get<float>();
     fanout = treeJson["fanout"].get<int>();
@@ -1085,11 +2299,32 @@ void LSMTree::deserialize(const std::string& filename) {
         levelIoCountAndTime.emplace_back(treeJson["levelIoCountAndTime"][i].get<size_t>(), 
         std::chrono::microseconds(treeJson["levelIoCountAndTime"][i + 1].get<size_t>()));
     }
+    if (treeJson.contains("levelGetStats")) {
+        for (size_t i = 0; i < treeJson["levelGetStats"].size() && i < MAX_LEVEL_GET_STATS; i++) {
+            const json &stats = treeJson["levelGetStats"][i];
+            LevelGetStats loaded{stats[0].get<size_t>(), stats[1].get<size_t>(), stats[2].get<size_t>()};
+            if (stats.size() >= 6) {
+                loaded.searches = stats[3].get<size_t>();
+                loaded.searchReads = stats[4].get<size_t>();
+                loaded.searchEntries = stats[5].get<size_t>();
+            }
+            levelGetCounters[i].store(loaded);
+        }
+    }
     getMisses = treeJson["getMisses"].get<size_t>();
     getHits = treeJson["getHits"].get<size_t>();
     rangeMisses = treeJson["rangeMisses"].get<size_t>();
     rangeHits = treeJson["rangeHits"].get<size_t>();
     commandCounter.store(treeJson["commandCounter"].get<uint64_t>());
+    filterMemoryBudgetBits = treeJson.value("filterMemoryBudgetBits", size_t(0));
+    optimizeForHits = treeJson.value("optimizeForHits", false);
+    rowCache = std::make_unique<RowCache>(treeJson.value("rowCacheCapacity", size_t(0)));
+    parallelGets = treeJson.value("parallelGets", false);
+    learnedIndexEpsilon = treeJson.value("learnedIndexEpsilon", size_t(0));
+    blockHashIndex = treeJson.value("blockHashIndex", false);
+    blockCache = std::make_unique<BlockCache>(treeJson.value("blockCacheCapacity", size_t(0)));
+    partitionedFilters = treeJson.value("partitionedFilters", false);
+    lastSequenceNumber = treeJson.value("lastSequenceNumber", uint64_t(0));
 
     buffer.deserialize(treeJson["buffer"]);
 
@@ -1107,6 +2342,7 @@ void LSMTree::deserialize(const std::string& filename) {
             run->setLSMTree(this);
         }
     }
+    publishVersion(nullptr);
     SyncedCout() << "Finished!\n" << std::endl;
     SyncedCout() << "Command line parameters will be ignored and configuration loaded from the saved database.\n" << std::endl;
 }
\ No newline at end of file
@@ -4,24 +4,86 @@
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/lock_algorithms.hpp>
 #include <optional>
+#include <functional>
+#include <array>
 #include "memtable.hpp"
 #include "level.hpp"
 #include "run.hpp"
 #include "threadpool.hpp"
+#include "row_cache.hpp"
+#include "block_cache.hpp"
+#include "run_interval_index.hpp"
+#include "merge_iterator.hpp"
 
 class Run;
 
+// The runs of a level in a version, newest first, with the index of their key ranges
+struct LevelVersion {
+    std::vector<std::shared_ptr<Run>> runs;
+    RunIntervalIndex intervals;
+};
+
+// An immutable snapshot of the tree's structure. Readers pin the current version with a single reference count
+// increment and search it without taking any lock, while flushes and compactions publish new versions.
+struct TreeVersion {
+    std::vector<std::shared_ptr<const Memtable>> immutableMemtables; // Full buffers that are being flushed, newest first
+    std::vector<LevelVersion> levels;                                // The runs of every level
+};
+
+// Receives the pairs of a range scan in key order and returns false to stop the scan
+using RangeCallback = std::function<bool(const kvPair&)>;
+
+// A range scan that is read in batches. It pins a version and copies the buffer's pairs in the range when it is opened,
+// so every batch sees the same point in time, and it holds one page of each of its runs between batches.
+struct RangeCursor {
+    std::map<KEY_t, VAL_t> bufferRange;
+    std::shared_ptr<const TreeVersion> version; // Null when the caller keeps the version alive, as for a snapshot
+    std::unique_ptr<MergeIterator> merge;
+    bool exhausted() const { return !merge->valid(); }
+};
+
+// The count, sum, minimum and maximum of the live values of a range
+struct RangeAggregate {
+    size_t count = 0;
+    int64_t sum = 0;
+    VAL_t minValue = VAL_MAX;
+    VAL_t maxValue = VAL_MIN;
+    void add(VAL_t value);
+    void add(const BlockStats& stats);
+};
+
 class LSMTree {
 public:
     // Constructor
     LSMTree(float bfErrorRate, int buffer_num_pages, int fanout, Level::Policy levelPolicy, size_t numThreads, 
-            float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency);
+            float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency,
+            double filterMemoryBudgetMB, bool optimizeForHits, size_t rowCacheCapacity, bool parallelGets,
+            size_t learnedIndexEpsilon, bool blockHashIndex, double blockCacheMB, bool partitionedFilters);
+    ~LSMTree();
 
     // DSL commands
     void put(KEY_t, VAL_t);
     std::unique_ptr<VAL_t> get(KEY_t key);
+    std::vector<std::unique_ptr<VAL_t>> multiGet(const std::vector<KEY_t>& keys);
     std::unique_ptr<std::vector<kvPair>> range(KEY_t start, KEY_t end);
+    size_t scanRange(KEY_t start, KEY_t end, const RangeCallback& callback);
+    size_t scanRange(KEY_t start, KEY_t end, size_t limit, const RangeCallback& callback);
+    std::unique_ptr<RangeCursor> openRangeCursor(KEY_t start, KEY_t end);
+    size_t readRangeCursor(RangeCursor& cursor, size_t limit, const RangeCallback& callback);
+    RangeAggregate aggregateRange(KEY_t start, KEY_t end);
+    size_t filterRange(KEY_t start, KEY_t end, VAL_t low, VAL_t high, const RangeCallback& callback);
+    RangeEstimate estimateRange(KEY_t start, KEY_t end);
     void del(KEY_t key);
+
+    // Snapshots, named by the sequence number of the last write they include
+    uint64_t createSnapshot();
+    bool releaseSnapshot(uint64_t sequenceNumber);
+    std::shared_ptr<const TreeVersion> getSnapshot(uint64_t sequenceNumber);
+    std::unique_ptr<VAL_t> get(KEY_t key, const TreeVersion& snapshot);
+    std::unique_ptr<std::vector<kvPair>> range(KEY_t start, KEY_t end, const TreeVersion& snapshot);
+    size_t scanRange(KEY_t start, KEY_t end, const TreeVersion& snapshot, const RangeCallback& callback);
+    RangeAggregate aggregateRange(KEY_t start, KEY_t end, const TreeVersion& snapshot);
+    size_t filterRange(KEY_t start, KEY_t end, VAL_t low, VAL_t high, const TreeVersion& snapshot, const RangeCallback& callback);
     void load(const std::string& filename);
     std::string printStats(ssize_t numToPrintFromEachLevel);
     void benchmark(const std::string& filename, bool verbose, size_t verboseFrequency);
@@ -50,15 +112,35 @@ public:
     std::string getDataDirectory() const { return dataDirectory; }
     bool getThroughputPrinting() const { return throughputPrinting; }
     size_t getThroughputFrequency() const { return throughputFrequency; }
+    double getFilterMemoryBudgetMB() const { return filterMemoryBudgetBits / 8.0 / (1024 * 1024); }
+    bool getOptimizeForHits() const { return optimizeForHits; }
+    size_t getRowCacheCapacity() const { return rowCache->getCapacity(); }
+    bool getParallelGets() const { return parallelGets; }
+    size_t getLearnedIndexEpsilon() const { return learnedIndexEpsilon; }
+    bool getBlockHashIndex() const { return blockHashIndex; }
+    BlockCache& getBlockCache() { return *blockCache; }
+    double getBlockCacheMB() const { return blockCache->getCapacity() / (1024.0 * 1024); }
+    bool getPartitionedFilters() const { return partitionedFilters; }
+    double getBloomFilterErrorRate(size_t numEntries, int levelNum);
 
     // Incrementers
-    void incrementBfFalsePositives();
-    void incrementBfTruePositives();
+    void incrementBfFalsePositives(int levelNum);
+    void incrementBfTruePositives(int levelNum);
+    void incrementBfNegatives(int levelNum);
+    void recordRunSearch(int levelNum, size_t reads, size_t entries);
     void incrementLevelIoCountAndTime(int levelNum, std::chrono::microseconds duration);
 
     // MONKEY Bloom filter optimization
     void monkeyOptimizeBloomFilters();
 
+    // Elastic Bloom filter tuning
+    void tuneBloomFilterUnits();
+    void startBloomFilterTuner();
+
+    // Global Bloom filter memory budget
+    void updateFilterBudgetLambda();
+    void resizeFiltersToBudget();
+
     // Serialization
     json serialize() const;
     void serializeLSMTreeToFile(const std::string& filename);
@@ -69,8 +151,8 @@ private:
     double bfErrorRate;
     unsigned int fanout;
     Level::Policy levelPolicy;
-    size_t bfFalsePositives = 0;
-    size_t bfTruePositives = 0;
+    std::atomic<size_t> bfFalsePositives{0};
+    std::atomic<size_t> bfTruePositives{0};
     Memtable buffer;
     ThreadPool threadPool;
     float compactionPercentage;
@@ -79,14 +161,90 @@ private:
     bool throughputPrinting;
     size_t throughputFrequency;
 
+    // Cache of get results in front of the tree version, invalidated by every put
+    std::unique_ptr<RowCache> rowCache;
+
+    // Parallel probing of the levels for gets
+    bool parallelGets;
+    std::unique_ptr<VAL_t> getFromLevelsInParallel(KEY_t key, const TreeVersion& version);
+    std::unique_ptr<VAL_t> getFromVersion(KEY_t key, const TreeVersion& version);
+
+    // Range queries over a buffer range and a version
+    bool checkRangeBounds(KEY_t& start, KEY_t& end);
+    RangeAggregate aggregateMerge(MergeIterator& it);
+    size_t filterMerge(MergeIterator& it, VAL_t low, VAL_t high, const RangeCallback& callback);
+    MergeIterator mergeRange(KEY_t start, KEY_t end, const std::map<KEY_t, VAL_t>& bufferResult, const TreeVersion& version,
+                             bool openRunsInParallel);
+    std::unique_ptr<RangeCursor> pinRange(KEY_t start, KEY_t end);
+    std::vector<KEY_t> partitionRange(KEY_t start, KEY_t end, const TreeVersion& version);
+    RangeEstimate estimateRuns(KEY_t start, KEY_t end, const TreeVersion& version);
+    double estimateNewestRunPairs(KEY_t start, KEY_t end, const TreeVersion& version);
+    size_t scanPartitions(KEY_t start, KEY_t end, const std::vector<KEY_t>& splitKeys,
+                          const std::map<KEY_t, VAL_t>& bufferResult, const TreeVersion& version, const RangeCallback& callback);
+
+    // Error bound of the learned index built for every new run, 0 if runs only have fence pointers
+    size_t learnedIndexEpsilon;
+
+    // Whether every new run writes a hash index for each of its pages, for point lookups
+    bool blockHashIndex;
+
+    // Cache of the pages of the run files and of the partitions of partitioned filters
+    std::unique_ptr<BlockCache> blockCache;
+
+    // Whether every new run writes its Bloom filter as partitions that are read on demand, instead of keeping it in memory
+    bool partitionedFilters;
+
+    // Tree versions for the read path
+    std::atomic<std::shared_ptr<const TreeVersion>> currentVersion{std::make_shared<const TreeVersion>()};
+    std::mutex versionMutex; // Serializes the writers publishing new versions
+    void publishFrozenBuffer(std::shared_ptr<const Memtable> frozenBuffer);
+    void publishVersion(const Memtable* flushedMemtable);
+
+    // Every put and delete takes the next sequence number, protected by bufferMutex
+    uint64_t lastSequenceNumber = 0;
+    // Live snapshots by sequence number. Each pins a version with a copy of the buffer in front of its immutable
+    // memtables, so the runs it reads are kept on disk even after compaction replaces them, until it is released.
+    struct Snapshot {
+        std::shared_ptr<const TreeVersion> version;
+        size_t handles = 0; // Snapshots taken at the same sequence number share the version
+    };
+    std::map<uint64_t, Snapshot> snapshots;
+    std::mutex snapshotsMutex;
+
     // Timer and IO count
     std::vector<std::pair<size_t, std::chrono::microseconds>> levelIoCountAndTime;
 
+    // Bloom filter outcomes and run file searches of gets per level
+    struct LevelGetStats {
+        size_t negatives = 0;       // Probes the filter ruled out
+        size_t falsePositives = 0;  // Probes that read a page without finding the key
+        size_t truePositives = 0;   // Probes that read a page and found the key
+        size_t searches = 0;        // Searches of a run file for a key
+        size_t searchReads = 0;     // Reads those searches made
+        size_t searchEntries = 0;   // Key-value pairs those reads fetched
+    };
+    // The counters behind LevelGetStats, updated by every filter probe and run search without a lock. They are kept
+    // in a fixed array, since a growing vector could move them under a concurrent update.
+    struct LevelGetCounters {
+        std::atomic<size_t> negatives{0};
+        std::atomic<size_t> falsePositives{0};
+        std::atomic<size_t> truePositives{0};
+        std::atomic<size_t> searches{0};
+        std::atomic<size_t> searchReads{0};
+        std::atomic<size_t> searchEntries{0};
+        LevelGetStats load() const;
+        void store(const LevelGetStats& stats);
+    };
+    std::array<LevelGetCounters, MAX_LEVEL_GET_STATS> levelGetCounters;
+    LevelGetCounters& getLevelGetCounters(int levelNum);
+    std::vector<LevelGetStats> getLevelGetStats() const;
+    std::string printLevelGetStats();
+    std::string printLevelIndexStats(const std::vector<Level*>& localLevelsCopy);
+
     // Compaction planning
     std::map<int, std::pair<int, int>> compactionPlan;
 
     // Private compaction functions
-    void removeTombstones(std::unique_ptr<std::vector<kvPair>> &rangeResult);
     void moveRuns(int currentLevelNum);
     void executeCompactionPlan();
     size_t getCompactionPlanSize();
@@ -98,12 +256,12 @@ private:
     ssize_t numLogicalPairs = NUM_LOGICAL_PAIRS_NOT_CACHED;
 
     // Tracking hits and misses for get and range
-    size_t getMisses = 0;
-    size_t getHits = 0;
-    size_t rangeMisses = 0;
-    size_t rangeHits = 0;
+    std::atomic<size_t> getMisses{0};
+    std::atomic<size_t> getHits{0};
+    std::atomic<size_t> rangeMisses{0};
+    std::atomic<size_t> rangeHits{0};
 
-    // Private functions for getting and incrementing with mutex locks
+    // Private functions for getting and incrementing the counters
     std::vector<Level*> getLocalLevelsCopy();
     void incrementGetMisses();
     void incrementGetHits();
@@ -116,17 +274,24 @@ private:
 
     // Private functions for MONKEY bloom filter optimization
     size_t getTotalBits() const;
+    size_t filterMemoryBudgetBits;        // 0 if there is no budget
+    bool optimizeForHits;                 // The last level has no filters and its memory goes to the upper levels
+    double filterBudgetLambda = 0;        // Error rate per entry of the current budget allocation, 0 until computed
+    mutable std::shared_mutex filterBudgetLambdaMutex;
     double TrySwitch(Run* run1, Run* run2, size_t delta, double R) const;
     double eval(size_t bits, size_t entries) const;
     double AutotuneFilters(size_t mFilters);
 
+    // Background tuner for the elastic Bloom filter units
+    void bloomFilterTunerLoop();
+    std::thread bloomFilterTunerThread;
+    std::mutex bloomFilterTunerMutex;
+    std::condition_variable bloomFilterTunerCv;
+    bool stopBloomFilterTuner = false;
+    bool filterBudgetResizePending = false; // A flush changed lambda, so the filters of existing runs are resized
+    std::mutex bloomFilterTuningMutex; // Serializes the tuner, MONKEY and deserialization
+
     // Mutexes used in getters and incrementers
-    mutable std::shared_mutex getHitsMutex;
-    mutable std::shared_mutex getMissesMutex;
-    mutable std::shared_mutex rangeHitsMutex;
-    mutable std::shared_mutex rangeMissesMutex;
-    mutable std::shared_mutex bfFalsePositivesMutex;
-    mutable std::shared_mutex bfTruePositivesMutex;
     mutable std::shared_mutex levelIoCountAndTimeMutex;
 
     // Mutexes used for buffer locking, compaction, and level locking
@@ -74,6 +74,16 @@ std::map<KEY_t, VAL_t>::const_reverse_iterator Memtable::rbegin() const {
     return table_.rbegin();
 }
 
+// Return an iterator to the first key-value pair whose key is not less than the given key
+std::map<KEY_t, VAL_t>::const_iterator Memtable::lowerBound(KEY_t key) const {
+    return table_.lower_bound(key);
+}
+
+// Count the pairs with keys in [start, end), tombstones included
+size_t Memtable::count(KEY_t start, KEY_t end) const {
+    return std::distance(table_.lower_bound(start), table_.lower_bound(end));
+}
+
 // Serialize the memtable to a JSON object
 json Memtable::serialize() const {
     json j;
@@ -22,6 +22,8 @@ public:
     std::map<KEY_t, VAL_t>::const_iterator begin() const;
     std::map<KEY_t, VAL_t>::const_iterator end() const;
     std::map<KEY_t, VAL_t>::const_reverse_iterator rbegin() const;
+    std::map<KEY_t, VAL_t>::const_iterator lowerBound(KEY_t key) const;
+    size_t count(KEY_t start, KEY_t end) const;
 
 private:
     size_t maxKvPairs;
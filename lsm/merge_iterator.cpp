@@ -0,0 +1,70 @@
+#include "merge_iterator.hpp"
+
+MemtableCursor::MemtableCursor(std::map<KEY_t, VAL_t>::const_iterator first, std::map<KEY_t, VAL_t>::const_iterator last) :
+    it(first), last(last)
+{
+    if (it != last) {
+        pair = {it->first, it->second};
+    }
+}
+
+void MemtableCursor::next() {
+    if (++it != last) {
+        pair = {it->first, it->second};
+    }
+}
+
+// The current keys of the cursors, or nothing for those without pairs
+static std::vector<std::optional<KEY_t>> currentKeys(const std::vector<std::unique_ptr<MergeCursor>>& cursors) {
+    std::vector<std::optional<KEY_t>> keys;
+    keys.reserve(cursors.size());
+    for (const auto &cursor : cursors) {
+        keys.push_back(cursor->valid() ? std::optional<KEY_t>(cursor->currentKey()) : std::nullopt);
+    }
+    return keys;
+}
+
+MergeIterator::MergeIterator(std::vector<std::unique_ptr<MergeCursor>> cursors) :
+    cursors(std::move(cursors)), tree(currentKeys(this->cursors))
+{
+}
+
+// Play the winning cursor again after it has moved
+void MergeIterator::replayWinner() {
+    const MergeCursor &cursor = *cursors[tree.winner()];
+    if (cursor.valid()) {
+        tree.advance(cursor.currentKey());
+    } else {
+        tree.retire();
+    }
+}
+
+// Move past the current key, advancing every cursor positioned on it so that its older values are skipped
+void MergeIterator::next() {
+    KEY_t key = tree.winnerKey();
+    while (!tree.empty() && tree.winnerKey() == key) {
+        cursors[tree.winner()]->next();
+        replayWinner();
+    }
+}
+
+// Return the statistics of a block the merge can take as a whole, or null. The newest cursor with the smallest key must
+// be at the start of a block that lies in the range, and no other cursor may have a key up to the block's last key, so
+// none of the block's pairs is shadowed by a newer source and none of them shadows an older one.
+const BlockStats* MergeIterator::currentBlock() const {
+    const BlockStats* stats = cursors[tree.winner()]->blockStats();
+    if (stats == nullptr) {
+        return nullptr;
+    }
+    std::optional<KEY_t> otherKey = tree.runnerUpKey();
+    if (otherKey.has_value() && *otherKey <= stats->lastKey) {
+        return nullptr;
+    }
+    return stats;
+}
+
+// Move past the block currentBlock() returned
+void MergeIterator::skipBlock() {
+    cursors[tree.winner()]->skipBlock();
+    replayWinner();
+}
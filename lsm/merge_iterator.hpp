@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <memory>
+#include <span>
+#include "data_types.hpp"
+#include "loser_tree.hpp"
+
+// A sorted stream of the key-value pairs of one source of a merge, such as a memtable or a run
+class MergeCursor {
+public:
+    virtual ~MergeCursor() = default;
+    virtual bool valid() const = 0;
+    virtual const kvPair& current() const = 0;
+    virtual void next() = 0;
+    // The key of the current pair, which a cursor may know before it reads the pair
+    virtual KEY_t currentKey() const { return current().key; }
+    // The statistics of the block the cursor is at the start of if the whole block is in the range, or else null
+    virtual const BlockStats* blockStats() const { return nullptr; }
+    // Move past the block that blockStats() describes without reading it
+    virtual void skipBlock() {}
+    // The pairs of the block that blockStats() describes, read if need be. They stay valid until the cursor moves.
+    virtual std::span<const kvPair> blockPairs() const { return {}; }
+};
+
+// Walks the pairs of a memtable's map between two iterators. The map must outlive the cursor.
+class MemtableCursor : public MergeCursor {
+public:
+    MemtableCursor(std::map<KEY_t, VAL_t>::const_iterator first, std::map<KEY_t, VAL_t>::const_iterator last);
+
+    bool valid() const override { return it != last; }
+    const kvPair& current() const override { return pair; }
+    void next() override;
+
+private:
+    std::map<KEY_t, VAL_t>::const_iterator it;
+    std::map<KEY_t, VAL_t>::const_iterator last;
+    kvPair pair;
+};
+
+// Merges cursors given from newest to oldest into one sorted stream with a single pair per key, the newest one. The
+// cursors play in a loser tree ordered by their current key and then by their position, so moving past a pair of one
+// source costs a comparison per level of the tree, and a run's cursor reads its next page only once the merge has used
+// up the current one.
+class MergeIterator {
+public:
+    explicit MergeIterator(std::vector<std::unique_ptr<MergeCursor>> cursors);
+
+    bool valid() const { return !tree.empty(); }
+    const kvPair& current() const { return cursors[tree.winner()]->current(); }
+    void next();
+    const BlockStats* currentBlock() const;
+    std::span<const kvPair> currentBlockPairs() const { return cursors[tree.winner()]->blockPairs(); }
+    void skipBlock();
+
+private:
+    std::vector<std::unique_ptr<MergeCursor>> cursors;
+    LoserTree<KEY_t> tree; // The winner is the cursor with the smallest key, the newest one among equal keys
+    void replayWinner();
+};
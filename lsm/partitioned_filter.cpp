@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <cmath>
+#include <unistd.h>
+#include "partitioned_filter.hpp"
+
+// Every partition gets the bits per key of the error rate, rounded up to whole words, and all partitions use the same
+// number of hash functions
+PartitionedFilter::PartitionedFilter(const std::vector<uint32_t>& fingerprints, double errorRate, std::ofstream& ofs) {
+    double bitsPerKey = -std::log(errorRate) / (std::log(2) * std::log(2));
+    numHashes = std::max(1, static_cast<int>(std::round(std::log(2) * bitsPerKey)));
+    size_t partitionKeys = BLOOM_FILTER_PARTITION_PAGES * getpagesize();
+    offsets.push_back(0);
+    std::vector<uint64_t> words;
+    for (size_t first = 0; first < fingerprints.size(); first += partitionKeys) {
+        size_t last = std::min(fingerprints.size(), first + partitionKeys);
+        size_t numWords = std::max<size_t>(1, std::ceil((last - first) * bitsPerKey / 64));
+        size_t numBits = numWords * 64;
+        words.assign(numWords, 0);
+        for (size_t i = first; i < last; i++) {
+            auto [hash1, hash2] = BloomFilter::hashFingerprint(fingerprints[i]);
+            for (int probe = 0; probe < numHashes; probe++) {
+                size_t index = (hash1 + probe * hash2) % numBits;
+                words[index / 64] |= uint64_t(1) << (index % 64);
+            }
+        }
+        ofs.write(reinterpret_cast<const char*>(words.data()), sizeof(uint64_t) * numWords);
+        offsets.push_back(offsets.back() + numWords);
+    }
+}
+
+// Probe a partition read from the partition file
+bool PartitionedFilter::contains(const std::vector<char>& partition, const KeyHash& hash) const {
+    const uint64_t *words = reinterpret_cast<const uint64_t*>(partition.data());
+    size_t numBits = partition.size() / sizeof(uint64_t) * 64;
+    auto [hash1, hash2] = hash;
+    for (int probe = 0; probe < numHashes; probe++) {
+        size_t index = (hash1 + probe * hash2) % numBits;
+        if (!(words[index / 64] & (uint64_t(1) << (index % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+json PartitionedFilter::serialize() const {
+    json j;
+    j["numHashes"] = numHashes;
+    j["offsets"] = offsets;
+    return j;
+}
+
+void PartitionedFilter::deserialize(const json& j) {
+    numHashes = j["numHashes"];
+    offsets = j["offsets"].get<std::vector<uint64_t>>();
+}
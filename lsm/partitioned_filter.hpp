@@ -0,0 +1,35 @@
+#pragma once
+#include <fstream>
+#include <vector>
+#include "data_types.hpp"
+#include "bloom_filter.hpp"
+#include <nlohmann/json.hpp>
+using json = nlohmann:: json;
+
+// A Bloom filter split into partitions that each cover the keys of BLOOM_FILTER_PARTITION_PAGES consecutive pages of a
+// run. The partitions are written to the run's partition file and only the partition index, the offset of every
+// partition in the file, stays in memory. The fence pointers give the page a key would be in, so a probe only needs the
+// one partition covering that page, which is read from the file on demand.
+class PartitionedFilter {
+public:
+    PartitionedFilter() = default;
+    // Build the partitions from the fingerprints of the run's keys, in key order, and write them to the stream
+    PartitionedFilter(const std::vector<uint32_t>& fingerprints, double errorRate, std::ofstream& ofs);
+
+    bool empty() const { return offsets.empty(); }
+    size_t getNumPartitions() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t getPartition(size_t pageIndex) const { return pageIndex / BLOOM_FILTER_PARTITION_PAGES; }
+    size_t getOffset(size_t partition) const { return offsets[partition] * sizeof(uint64_t); }
+    size_t getBytes(size_t partition) const { return (offsets[partition + 1] - offsets[partition]) * sizeof(uint64_t); }
+    size_t getNumBits() const { return offsets.empty() ? 0 : offsets.back() * 64; }
+    int getNumHashes() const { return numHashes; }
+    size_t getIndexBytes() const { return offsets.size() * sizeof(uint64_t); }
+    bool contains(const std::vector<char>& partition, const KeyHash& hash) const;
+
+    json serialize() const;
+    void deserialize(const json& j);
+
+private:
+    std::vector<uint64_t> offsets; // Word offset of every partition in the partition file, then the end of the last one
+    int numHashes = 0;
+};
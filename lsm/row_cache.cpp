@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <bit>
+#include "row_cache.hpp"
+
+namespace {
+// The splitmix64 finalizer, used to spread keys over the shards and the sketch rows
+uint64_t mixKey(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+}
+
+RowCache::RowCache(size_t capacity) : capacity(capacity) {
+    if (capacity == 0) {
+        return;
+    }
+    size_t shardCapacity = (capacity + ROW_CACHE_NUM_SHARDS - 1) / ROW_CACHE_NUM_SHARDS;
+    shards.reserve(ROW_CACHE_NUM_SHARDS);
+    for (size_t i = 0; i < ROW_CACHE_NUM_SHARDS; i++) {
+        shards.push_back(std::make_unique<Shard>(shardCapacity));
+    }
+}
+
+RowCache::Shard& RowCache::getShard(KEY_t key) {
+    return *shards[mixKey(static_cast<uint32_t>(key)) % shards.size()];
+}
+
+// Look up a key and count the access for admission. On a miss, epoch is set to the key's shard epoch, which must be
+// passed to insert() once the key has been read from the tree. The lookup has to happen before the buffer is read.
+bool RowCache::lookup(KEY_t key, Result& result, uint64_t& epoch) {
+    if (capacity == 0) {
+        return false;
+    }
+    Shard& shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.sketch.increment(key);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        epoch = shard.epoch;
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    result = it->second->second;
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Cache the result of a lookup unless the key's shard was invalidated since the lookup. A full shard evicts its least
+// recently used entry, but only if the new key is more frequent than the victim.
+void RowCache::insert(KEY_t key, Result result, uint64_t epoch) {
+    if (capacity == 0) {
+        return;
+    }
+    Shard& shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.epoch != epoch) {
+        return;
+    }
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        it->second->second = result;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return;
+    }
+    if (shard.entries.size() >= shard.capacity) {
+        KEY_t victim = shard.lru.back().first;
+        if (shard.sketch.estimate(key) <= shard.sketch.estimate(victim)) {
+            rejections.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        shard.entries.erase(victim);
+        shard.lru.pop_back();
+    }
+    shard.lru.emplace_front(key, result);
+    shard.entries[key] = shard.lru.begin();
+}
+
+// Drop a key that was written. Must be called after the write is visible in the buffer.
+void RowCache::invalidate(KEY_t key) {
+    if (capacity == 0) {
+        return;
+    }
+    Shard& shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.epoch++;
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        shard.lru.erase(it->second);
+        shard.entries.erase(it);
+    }
+}
+
+RowCache::FrequencySketch::FrequencySketch(size_t capacity) :
+    width(std::bit_ceil(std::max<size_t>(capacity * ROW_CACHE_SKETCH_WIDTH_FACTOR, 1))),
+    sampleSize(std::max<size_t>(capacity * ROW_CACHE_SKETCH_SAMPLE_FACTOR, 1))
+{
+    counters.assign(ROW_CACHE_SKETCH_DEPTH * width, 0);
+}
+
+size_t RowCache::FrequencySketch::getIndex(KEY_t key, size_t row) const {
+    uint64_t hash = mixKey(static_cast<uint32_t>(key) + (static_cast<uint64_t>(row + 1) << 32));
+    return row * width + (hash & (width - 1));
+}
+
+void RowCache::FrequencySketch::increment(KEY_t key) {
+    for (size_t row = 0; row < ROW_CACHE_SKETCH_DEPTH; row++) {
+        uint8_t& counter = counters[getIndex(key, row)];
+        if (counter < ROW_CACHE_SKETCH_COUNTER_MAX) {
+            counter++;
+        }
+    }
+    if (++additions >= sampleSize) {
+        for (auto& counter : counters) {
+            counter /= 2;
+        }
+        additions /= 2;
+    }
+}
+
+uint8_t RowCache::FrequencySketch::estimate(KEY_t key) const {
+    uint8_t minimum = ROW_CACHE_SKETCH_COUNTER_MAX;
+    for (size_t row = 0; row < ROW_CACHE_SKETCH_DEPTH; row++) {
+        minimum = std::min(minimum, counters[getIndex(key, row)]);
+    }
+    return minimum;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <list>
+#include <unordered_map>
+#include <optional>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include "data_types.hpp"
+
+// A sharded cache of get results in front of the tree's immutable memtables and levels. An entry holds the value found
+// for a key, which may be a tombstone, or no value at all if the key is absent, so repeated misses are answered from
+// memory too. Each shard is an LRU list behind its own mutex. New keys are admitted with TinyLFU: once a shard is full,
+// a key only replaces the LRU victim if a count-min sketch estimates that it was requested more often, so a scan of cold
+// keys cannot flush the hot ones.
+class RowCache {
+public:
+    using Result = std::optional<VAL_t>; // std::nullopt if the key is not in the tree
+
+    explicit RowCache(size_t capacity);
+
+    bool lookup(KEY_t key, Result& result, uint64_t& epoch);
+    void insert(KEY_t key, Result result, uint64_t epoch);
+    void invalidate(KEY_t key);
+
+    size_t getCapacity() const { return capacity; }
+    size_t getHits() const { return hits.load(std::memory_order_relaxed); }
+    size_t getMisses() const { return misses.load(std::memory_order_relaxed); }
+    size_t getRejections() const { return rejections.load(std::memory_order_relaxed); }
+
+private:
+    // A count-min sketch of small saturating counters. All counters are halved once the number of recorded accesses
+    // reaches the sample size, so the estimates follow recent popularity.
+    class FrequencySketch {
+    public:
+        explicit FrequencySketch(size_t capacity);
+        void increment(KEY_t key);
+        uint8_t estimate(KEY_t key) const;
+    private:
+        std::vector<uint8_t> counters; // ROW_CACHE_SKETCH_DEPTH rows of width counters each
+        size_t width;
+        size_t sampleSize;
+        size_t additions = 0;
+        size_t getIndex(KEY_t key, size_t row) const;
+    };
+
+    struct Shard {
+        explicit Shard(size_t capacity) : capacity(capacity), sketch(capacity) {}
+        std::mutex mutex;
+        size_t capacity;
+        std::list<std::pair<KEY_t, Result>> lru; // Most recently used first
+        std::unordered_map<KEY_t, std::list<std::pair<KEY_t, Result>>::iterator> entries;
+        FrequencySketch sketch;
+        uint64_t epoch = 0; // Bumped by every invalidation, so results read before a write are not inserted after it
+    };
+
+    size_t capacity;
+    std::vector<std::unique_ptr<Shard>> shards;
+    Shard& getShard(KEY_t key);
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+    std::atomic<size_t> rejections{0}; // Keys TinyLFU did not admit
+};
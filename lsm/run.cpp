@@ -1,3 +1,4 @@
+#include <cstddef>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -9,18 +10,41 @@
 #include <queue>
 #include <vector>
 #include <random>
+#include <array>
+#include <unistd.h>
 #include "../lib/binary_search.hpp"
 #include "run.hpp"
+#include "block_hash_index.hpp"
 #include "lsm_tree.hpp"
 #include "memtable.hpp"
 #include "utils.hpp"
 
+namespace {
+// The filter size from which the probes of a batch are interleaved. The coroutines cost more than a plain probe of a
+// filter in the cache, and with batches of GET_BATCH_SIZE keys only win once the filter is many times the size of the
+// L2 cache, so most probes miss every cache level.
+size_t interleavedLookupMinFilterBits() {
+    static const size_t minBits = [] {
+        size_t l2Bytes = DEFAULT_L2_CACHE_BYTES;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        long queried = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        if (queried > 0) {
+            l2Bytes = static_cast<size_t>(queried);
+        }
+#endif
+        return l2Bytes * INTERLEAVED_LOOKUP_L2_MULTIPLE * 8;
+    }();
+    return minBits;
+}
+}
+
 Run::Run(size_t maxKvPairs, double bfErrorRate, bool createFile, size_t levelOfRun, LSMTree* lsmTree = nullptr) :
     maxKvPairs(maxKvPairs),
     bfErrorRate(bfErrorRate),
     levelOfRun(levelOfRun),
     lsmTree(lsmTree),
-    bloomFilter(maxKvPairs, bfErrorRate),
+    // A new run with a partitioned filter keeps no filter bits in memory
+    bloomFilter(std::make_shared<BloomFilter>(maxKvPairs, (createFile && lsmTree->getPartitionedFilters()) ? 1.0 : bfErrorRate)),
     runFileName(""),
     size(0),
     maxKey(KEY_MIN)
@@ -43,19 +67,41 @@ Run::Run(size_t maxKvPairs, double bfErrorRate, bool createFile, size_t levelOfR
 
         tmpOfs.close();
         runFileName = tmpFn;
-        fencePointers.reserve(maxKvPairs / getpagesize());
     }
 }
 
 
-Run::~Run() {}
+// A run replaced by compaction is only deleted from disk when the last tree version using it is released
+Run::~Run() {
+    if (obsolete) {
+        deleteFile();
+    }
+}
 
 std::string Run::getRunFilePath() {
     return lsmTree->getDataDirectory() + "/" + runFileName;
 }
 
+// Return the path of the file holding the run's Bloom filter units, named after the run file
+std::string Run::getBloomFilterFilePath() {
+    return lsmTree->getDataDirectory() + "/" + runFileName.substr(0, runFileName.find_last_of('.')) + BLOOM_FILTER_FILE_EXTENSION;
+}
+
+// Return the path of the file holding the fingerprints of the run's keys, used to rebuild its Bloom filter
+std::string Run::getFingerprintFilePath() {
+    return lsmTree->getDataDirectory() + "/" + runFileName.substr(0, runFileName.find_last_of('.')) + FINGERPRINT_FILE_EXTENSION;
+}
+
+// Return the path of the file holding the partitions of the run's partitioned filter
+std::string Run::getPartitionedFilterFilePath() {
+    return lsmTree->getDataDirectory() + "/" + runFileName.substr(0, runFileName.find_last_of('.')) + PARTITIONED_FILTER_FILE_EXTENSION;
+}
+
 void Run::deleteFile() {
     remove(getRunFilePath().c_str());
+    remove(getBloomFilterFilePath().c_str());
+    remove(getFingerprintFilePath().c_str());
+    remove(getPartitionedFilterFilePath().c_str());
 }
 
 // New function to open the output file stream
@@ -92,34 +138,96 @@ void Run::closeInputFileStream(std::ifstream& ifs) {
     }
 }
 
+// Write the run's files. The run is not yet part of a tree version, so its filter and metadata are built in place.
 void Run::flush(std::unique_ptr<std::vector<kvPair>> kvPairs) {
     std::ofstream ofs;
-    {
-        std::shared_lock<std::shared_mutex> lock(sizeMutex);
-        if (size >= maxKvPairs) {
-            die("Run::flush: Attempting to add to full Run: " + getRunFilePath());
-        }
+    if (size >= maxKvPairs) {
+        die("Run::flush: Attempting to add to full Run: " + getRunFilePath());
     }
-    // First pass: Add Bloom filters and fence pointers
+    std::shared_ptr<BloomFilter> filter = bloomFilter.load();
+    // First pass: Add Bloom filters and fence pointers, and collect the key fingerprints
     size_t idx = 0;
+    std::vector<uint32_t> fingerprints;
+    fingerprints.reserve(kvPairs->size());
+    std::vector<KEY_t> fencePointers;
 
     for (const auto &kv : *kvPairs) {
-        addToBloomFilter(kv.key);
+        fingerprints.push_back(BloomFilter::fingerprint(kv.key));
+        filter->addFingerprint(fingerprints.back());
 
         if (idx % getpagesize() == 0) {
-            addFencePointer(kv.key);
+            fencePointers.push_back(kv.key);
+            pageStats.push_back({kv.key, 0, 0, VAL_MAX, VAL_MIN, 0});
+        }
+        BlockStats &stats = pageStats.back();
+        stats.lastKey = kv.key;
+        if (kv.value != TOMBSTONE) {
+            stats.count++;
+            stats.sum += kv.value;
+            stats.minValue = std::min(stats.minValue, kv.value);
+            stats.maxValue = std::max(stats.maxValue, kv.value);
+        } else {
+            stats.tombstones++;
         }
-        if (kv.key > getMaxKey()) {
-            setMaxKey(kv.key);
+        if (kv.key > maxKey) {
+            maxKey = kv.key;
         }
         ++idx;
     }
-    // Second pass: Write the data to the Run file
+    // Second pass: Write the data to the Run file, every page as its keys followed by its values
     openOutputFileStream(ofs, "Run::flush: Failed to open file for Run");
-    ofs.write(reinterpret_cast<const char*>(kvPairs->data()), sizeof(kvPair) * kvPairs->size());
+    std::vector<KEY_t> keys;
+    std::vector<VAL_t> values;
+    for (size_t pageStart = 0; pageStart < kvPairs->size(); pageStart += getpagesize()) {
+        size_t pageEntries = std::min<size_t>(getpagesize(), kvPairs->size() - pageStart);
+        keys.resize(pageEntries);
+        values.resize(pageEntries);
+        for (size_t i = 0; i < pageEntries; i++) {
+            keys[i] = (*kvPairs)[pageStart + i].key;
+            values[i] = (*kvPairs)[pageStart + i].value;
+        }
+        ofs.write(reinterpret_cast<const char*>(keys.data()), sizeof(KEY_t) * pageEntries);
+        ofs.write(reinterpret_cast<const char*>(values.data()), sizeof(VAL_t) * pageEntries);
+    }
+    hasColumnarPages = true;
+    if (lsmTree->getBlockHashIndex()) {
+        // The hash indexes of the pages follow the data in page order
+        for (size_t pageStart = 0; pageStart < kvPairs->size(); pageStart += getpagesize()) {
+            size_t pageEntries = std::min<size_t>(getpagesize(), kvPairs->size() - pageStart);
+            std::vector<uint16_t> buckets = BlockHashIndex::build(kvPairs->data() + pageStart, pageEntries);
+            ofs.write(reinterpret_cast<const char*>(buckets.data()), sizeof(uint16_t) * buckets.size());
+        }
+        hasBlockHashIndex = true;
+    }
     ofs.flush();
     closeOutputFileStream(ofs);
-    setSize(kvPairs->size());
+    // Store the fingerprints so the Bloom filter can be rebuilt at any size without reading the Run file
+    std::ofstream fpOfs(getFingerprintFilePath(), std::ios::out | std::ios::binary);
+    if (!fpOfs.is_open()) {
+        die("Run::flush: Failed to open fingerprint file for Run: " + getFingerprintFilePath());
+    }
+    fpOfs.write(reinterpret_cast<const char*>(fingerprints.data()), sizeof(uint32_t) * fingerprints.size());
+    fpOfs.close();
+    if (lsmTree->getPartitionedFilters() && bfErrorRate < 1) {
+        std::ofstream pfOfs(getPartitionedFilterFilePath(), std::ios::out | std::ios::binary);
+        if (!pfOfs.is_open()) {
+            die("Run::flush: Failed to open partitioned filter file for Run: " + getPartitionedFilterFilePath());
+        }
+        partitionedFilter = PartitionedFilter(fingerprints, bfErrorRate, pfOfs);
+        pfOfs.close();
+    }
+    // Store every Bloom filter unit and keep only the enabled ones in memory
+    {
+        std::lock_guard<std::mutex> lock(bloomFilterMutex);
+        writeBloomFilterUnits(*filter);
+    }
+    fenceIndex = FenceIndex(fencePointers);
+    keySketch = KeySketch(fingerprints);
+    if (lsmTree->getLearnedIndexEpsilon() > 0) {
+        learnedIndex = LearnedIndex(*kvPairs, lsmTree->getLearnedIndexEpsilon());
+    }
+    // The filter tuner skips empty runs, so the run only becomes visible to it once all its files are written
+    size = kvPairs->size();
 }
 
 
@@ -129,153 +237,672 @@ void Run::setFirstAndLastKeys(KEY_t first, KEY_t last) {
 }
 
 std::unique_ptr<VAL_t> Run::get(KEY_t key) {
-    size_t runSize;
-    std::ifstream ifs;
-    {
-        std::shared_lock<std::shared_mutex> lock(sizeMutex);
-        runSize = size;
+    if (!mayContain(key)) {
+        return nullptr;
     }
+    return readValue(key);
+}
+
+// Check the key against the run's key range and Bloom filter without reading the run
+bool Run::mayContain(KEY_t key) {
     // Check if the run is empty
-    if (runSize == 0) {
-        return nullptr;
+    if (size == 0) {
+        return false;
     }
-    auto fencePointersCopy = getFencePointers();
     // Check if it is in the range of the fence pointers
-    if (key < fencePointersCopy.front() || key > getMaxKey()) {
-        return nullptr;
+    if (key < fenceIndex.front() || key > maxKey) {
+        return false;
     }
-    {
-        // Separately check if it is in the bloom filter under a shared lock
-        std::shared_lock<std::shared_mutex> lock(bloomFilterMutex);
-        if (!bloomFilter.contains(key)) {
-            return nullptr;
+    bloomFilterProbes.fetch_add(1, std::memory_order_relaxed);
+    KeyHash hash = BloomFilter::hashKey(key);
+    if (!bloomFilter.load()->containsHash(hash) || (hasPartitionedFilter() && !partitionContains(fenceIndex.findPage(key), hash))) {
+        lsmTree->incrementBfNegatives(levelOfRun);
+        return false;
+    }
+    return true;
+}
+
+// Probe the filter partition covering a page, which is read from the partition file unless the block cache holds it
+bool Run::partitionContains(size_t pageIndex, const KeyHash& hash) {
+    size_t partition = partitionedFilter.getPartition(pageIndex);
+    BlockCache& cache = lsmTree->getBlockCache();
+    BlockCache::Block bits = cache.lookup(filterFileId, partition, BlockCache::Kind::FILTER);
+    if (bits == nullptr) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        std::ifstream ifs(getPartitionedFilterFilePath(), std::ios::in | std::ios::binary);
+        if (!ifs.is_open()) {
+            die("Run::partitionContains: Failed to open partitioned filter file for Run: " + getPartitionedFilterFilePath());
         }
+        auto loaded = std::make_shared<std::vector<char>>(partitionedFilter.getBytes(partition));
+        ifs.seekg(partitionedFilter.getOffset(partition), std::ios::beg);
+        ifs.read(loaded->data(), loaded->size());
+        cache.insert(filterFileId, partition, loaded);
+        bits = std::move(loaded);
+        auto end_time = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+        lsmTree->incrementLevelIoCountAndTime(levelOfRun, duration);
     }
-    // Perform a binary search on the fence pointers to find the page that may contain the key
-    auto iter = std::upper_bound(fencePointersCopy.begin(), fencePointersCopy.end(), key);
-    size_t pageIndex = std::distance(fencePointersCopy.begin(), iter) - 1;
+    return partitionedFilter.contains(*bits, hash);
+}
 
-    // Calculate the start and end position of the range to search based on the page index
-    size_t start = pageIndex * getpagesize();
-    size_t end = (pageIndex + 1 == fencePointersCopy.size()) ? runSize : (pageIndex + 1) * getpagesize();
-    
-    // Start the timer for the query
+// Look up the keys whose values are still null, given their filter hashes. When the run's filter is too large to stay
+// in the cache and enough of the keys probe it, the Bloom filter probes and fence searches run as interleaved lookups,
+// so the cache misses of the batch overlap. The keys that pass the filter are grouped by page, and a page holding several of them is read once. Found
+// values (including tombstones) are stored in values.
+void Run::getBatch(const std::vector<KEY_t>& keys, const std::vector<KeyHash>& hashes,
+                   std::vector<std::unique_ptr<VAL_t>>& values) {
+    if (size == 0) {
+        return;
+    }
+    std::vector<KEY_t> candidates;
+    std::vector<size_t> candidateIndices;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (values[i] == nullptr && keys[i] >= fenceIndex.front() && keys[i] <= maxKey) {
+            candidates.push_back(keys[i]);
+            candidateIndices.push_back(i);
+        }
+    }
+    if (candidates.empty()) {
+        return;
+    }
+    bloomFilterProbes.fetch_add(candidates.size(), std::memory_order_relaxed);
+    std::shared_ptr<BloomFilter> filter = bloomFilter.load();
+    // The page, key and position in keys of every key that passed the filter
+    std::vector<std::tuple<size_t, KEY_t, size_t>> positives;
+    auto addResult = [&](size_t j, const std::optional<size_t>& pageIndex) {
+        if (!pageIndex.has_value() ||
+            (hasPartitionedFilter() && !partitionContains(*pageIndex, hashes[candidateIndices[j]]))) {
+            lsmTree->incrementBfNegatives(levelOfRun);
+            return;
+        }
+        positives.emplace_back(*pageIndex, candidates[j], candidateIndices[j]);
+    };
+    if (candidates.size() < INTERLEAVED_LOOKUP_MIN_KEYS || filter->getNumBits() < interleavedLookupMinFilterBits()) {
+        // Switching between lookups costs more than the misses it hides, unless the filter is far larger than the cache
+        // and enough keys probe it to keep a group of lookups in flight
+        for (size_t j = 0; j < candidates.size(); j++) {
+            if (filter->containsHash(hashes[candidateIndices[j]])) {
+                addResult(j, fenceIndex.findPage(candidates[j]));
+            } else {
+                addResult(j, std::nullopt);
+            }
+        }
+    } else {
+        runInterleaved<std::optional<size_t>>(candidates.size(), INTERLEAVED_LOOKUP_GROUP_SIZE,
+            [&](size_t j) { return locatePage(candidates[j], hashes[candidateIndices[j]], filter.get()); }, addResult);
+    }
+    std::sort(positives.begin(), positives.end());
+
+    for (size_t first = 0; first < positives.size();) {
+        auto [pageIndex, firstKey, firstIndex] = positives[first];
+        size_t last = first + 1;
+        while (last < positives.size() && std::get<0>(positives[last]) == pageIndex) {
+            last++;
+        }
+        if (last - first == 1) {
+            values[firstIndex] = readValue(firstKey);
+        } else {
+            readPageValues(pageIndex, positives.begin() + first, positives.begin() + last, values);
+        }
+        first = last;
+    }
+}
+
+// Look up several keys of one page, given as (page, key, position in values) in key order. The page's keys are read and
+// searched first, and since the values of a page are in key order too, those of the keys found lie in one stretch that
+// is read next, so the values of the other keys are never read. With a block cache, the whole page is searched in memory.
+void Run::readPageValues(size_t pageIndex, std::vector<std::tuple<size_t, KEY_t, size_t>>::const_iterator first,
+                         std::vector<std::tuple<size_t, KEY_t, size_t>>::const_iterator last,
+                         std::vector<std::unique_ptr<VAL_t>>& values) {
+    std::ifstream ifs;
+    if (lsmTree->getBlockCache().getCapacity() > 0) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        bool read;
+        BlockCache::Block page = getPage(ifs, pageIndex, read);
+        size_t pageEntries = page->size() / sizeof(kvPair);
+        for (auto it = first; it != last; ++it) {
+            auto [pageOfKey, key, index] = *it;
+            size_t position = pageLowerBound(*page, key);
+            bool hit = (position < pageEntries && pageEntry(*page, position).key == key);
+            countFilterPositive(hit);
+            if (hit) {
+                values[index] = std::make_unique<VAL_t>(pageEntry(*page, position).value);
+            }
+        }
+        if (read) {
+            closeInputFileStream(ifs);
+            auto end_time = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+            lsmTree->incrementLevelIoCountAndTime(levelOfRun, duration);
+        }
+        return;
+    }
+    openInputFileStream(ifs, "Run::getBatch: Failed to open file for Run");
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    std::unique_ptr<kvPair> kv;
-    {
-        openInputFileStream(ifs, "Run::get: Failed to open file for Run");
-        std::size_t keyPos;
-        std::tie(keyPos, kv) = binarySearchInRange(ifs, start, end, key);
-        closeInputFileStream(ifs);
+    size_t pageStart = pageIndex * getpagesize();
+    std::vector<KEY_t> pageKeys;
+    readKeys(ifs, pageStart, pageStart + getPageEntries(pageIndex), pageKeys);
+    std::vector<std::pair<size_t, size_t>> found; // Position of every key found in the page and in values
+    for (auto it = first; it != last; ++it) {
+        auto [page, key, index] = *it;
+        size_t position = branchless_lower_bound(pageKeys.begin(), pageKeys.end(), key) - pageKeys.begin();
+        bool hit = (position < pageKeys.size() && pageKeys[position] == key);
+        countFilterPositive(hit);
+        if (hit) {
+            found.emplace_back(position, index);
+        }
     }
-    if (kv == nullptr) {
-        // If the key was not found, increment the false positive count
-        lsmTree->incrementBfFalsePositives();
-        incrementFalsePositives();
-    } else {
-        // If the key was found, increment the true positive count
-        lsmTree->incrementBfTruePositives();
-        incrementTruePositives();
+    if (!found.empty()) {
+        std::vector<VAL_t> pageValues;
+        readValues(ifs, pageStart + found.front().first, pageStart + found.back().first + 1, pageValues);
+        for (auto [position, index] : found) {
+            values[index] = std::make_unique<VAL_t>(pageValues[position - found.front().first]);
+        }
     }
+    closeInputFileStream(ifs);
 
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-
     lsmTree->incrementLevelIoCountAndTime(levelOfRun, duration);
+}
 
-    return (kv == nullptr) ? nullptr : std::make_unique<VAL_t>(kv->value);
+// Find the page that may hold a key, or nothing if the Bloom filter rules it out. The lookup suspends before every
+// filter word and Eytzinger fence node it reads, so that runInterleaved() can work on other keys while it is fetched.
+InterleavedLookup<std::optional<size_t>> Run::locatePage(KEY_t key, KeyHash hash, const BloomFilter* filter) {
+    for (size_t probe = 0; probe < filter->getNumProbes(); probe++) {
+        uint64_t mask;
+        const uint64_t* word = filter->getProbeWord(hash.first, hash.second, probe, mask);
+        co_await PrefetchAwaiter{word};
+        if (!(*word & mask)) {
+            co_return std::nullopt;
+        }
+    }
+    if (!fenceIndex.isEytzinger()) {
+        co_return fenceIndex.findPage(key);
+    }
+    // The first cache line of the fences is shared by every lookup of the run, so only the deeper levels suspend
+    size_t slot = 1;
+    do {
+        if (slot >= FENCE_INDEX_PREFETCH_STRIDE) {
+            co_await PrefetchAwaiter{fenceIndex.getSearchNode(slot)};
+        }
+    } while (fenceIndex.searchStep(slot, key));
+    co_return fenceIndex.getSearchResult(slot);
 }
 
-// Return a pair of the position of a KvPair, and a pointer to the KvPair
-std::pair<size_t, std::unique_ptr<kvPair>> Run::binarySearchInRange(std::ifstream &ifs, size_t start, size_t end, KEY_t key) {
-    while (start <= end) {
-        size_t mid = start + (end - start) / 2;
+// Read a page from an open run file into the block for a range. A page in the block cache is taken from it, but a page
+// read from the file is not added, so a long range does not evict the hot pages and filter partitions of the gets.
+// Only a page read from the file counts as an I/O.
+void Run::readBlock(std::ifstream& ifs, size_t pageIndex, std::vector<kvPair>& block) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    bool read;
+    BlockCache::Block page = getPage(ifs, pageIndex, read, false);
+    pagePairs(*page, block);
+    if (!read) {
+        return;
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
 
-        // Read the key-value pair at the mid index
-        kvPair kv;
-        ifs.seekg(mid * sizeof(kvPair), std::ios::beg);
-        ifs.read(reinterpret_cast<char*>(&kv), sizeof(kvPair));
+    lsmTree->incrementLevelIoCountAndTime(levelOfRun, duration);
+}
 
-        if (kv.key == key) {
-            std::unique_ptr<kvPair> found_kv = std::make_unique<kvPair>(kv);
-            return std::make_pair(mid, std::move(found_kv));
-        } else if (kv.key < key) {
-            start = mid + 1;
-        } else {
-            end = mid - 1;
+// Read a page as key-value pairs with a single read, bypassing the block cache
+void Run::readPage(std::ifstream& ifs, size_t pageIndex, std::vector<kvPair>& block) {
+    if (!hasColumnarPages) {
+        block.resize(getPageEntries(pageIndex));
+        ifs.seekg(pageIndex * getpagesize() * sizeof(kvPair), std::ios::beg);
+        ifs.read(reinterpret_cast<char*>(block.data()), sizeof(kvPair) * block.size());
+        return;
+    }
+    pagePairs(readPageBytes(ifs, pageIndex), block);
+}
+
+// Read a page as it is stored in the run file
+std::vector<char> Run::readPageBytes(std::ifstream& ifs, size_t pageIndex) {
+    std::vector<char> page(sizeof(kvPair) * getPageEntries(pageIndex));
+    ifs.seekg(pageIndex * getpagesize() * sizeof(kvPair), std::ios::beg);
+    ifs.read(page.data(), page.size());
+    return page;
+}
+
+// Return a page as it is stored in the run file, from the block cache, or else read from the file and added to the
+// cache if fillCache is set. Sets read to whether the file was read, for which the stream is opened if it is not open
+// yet.
+BlockCache::Block Run::getPage(std::ifstream& ifs, size_t pageIndex, bool& read, bool fillCache) {
+    BlockCache& cache = lsmTree->getBlockCache();
+    BlockCache::Block page = cache.lookup(dataFileId, pageIndex, BlockCache::Kind::DATA);
+    read = (page == nullptr);
+    if (read) {
+        openInputFileStream(ifs, "Run::getPage: Failed to open file for Run");
+        auto loaded = std::make_shared<std::vector<char>>(readPageBytes(ifs, pageIndex));
+        if (fillCache) {
+            cache.insert(dataFileId, pageIndex, loaded);
         }
+        page = std::move(loaded);
     }
-    return std::make_pair(start, nullptr);
+    return page;
 }
 
+// Pair up the keys and values of a page as it is stored in the run file
+void Run::pagePairs(const std::vector<char>& page, std::vector<kvPair>& block) const {
+    block.resize(page.size() / sizeof(kvPair));
+    for (size_t i = 0; i < block.size(); i++) {
+        block[i] = pageEntry(page, i);
+    }
+}
 
-// Return a map of all the key-value pairs in the range [start, end)
-std::vector<kvPair> Run::range(KEY_t start, KEY_t end) {
-    std::ifstream ifs;
-    size_t searchPageStart, runSize;
-    std::vector<kvPair> rangeVec;
+// Return the position of the first key of a page, as stored in the run file, that is not less than the key
+size_t Run::pageLowerBound(const std::vector<char>& page, KEY_t key) const {
+    size_t pageEntries = page.size() / sizeof(kvPair);
+    if (hasColumnarPages) {
+        const KEY_t *keys = reinterpret_cast<const KEY_t*>(page.data());
+        return branchless_lower_bound(keys, keys + pageEntries, key) - keys;
+    }
+    const kvPair *pairs = reinterpret_cast<const kvPair*>(page.data());
+    return std::lower_bound(pairs, pairs + pageEntries, key,
+                            [](const kvPair& kv, KEY_t k) { return kv.key < k; }) - pairs;
+}
 
-    // Check if the run is empty
-    {
-        std::shared_lock<std::shared_mutex> lock(sizeMutex);
-        runSize = size;
+// Return the pair at a position of a page as stored in the run file
+kvPair Run::pageEntry(const std::vector<char>& page, size_t position) const {
+    if (!hasColumnarPages) {
+        return reinterpret_cast<const kvPair*>(page.data())[position];
     }
-    // Check if the run is empty. If so, return an empty result set.
-    if (runSize == 0) {
-        return rangeVec;
+    size_t pageEntries = page.size() / sizeof(kvPair);
+    const KEY_t *keys = reinterpret_cast<const KEY_t*>(page.data());
+    const VAL_t *values = reinterpret_cast<const VAL_t*>(page.data() + sizeof(KEY_t) * pageEntries);
+    return {keys[position], values[position]};
+}
+
+// Search the page that may hold the key in memory, taking it from the block cache or reading all of it once
+std::unique_ptr<kvPair> Run::searchPage(std::ifstream& ifs, KEY_t key, bool& read) {
+    BlockCache::Block page = getPage(ifs, fenceIndex.findPage(key), read);
+    size_t pageEntries = page->size() / sizeof(kvPair);
+    size_t position = pageLowerBound(*page, key);
+    lsmTree->recordRunSearch(levelOfRun, read ? 1 : 0, read ? pageEntries : 0);
+    if (position < pageEntries && pageEntry(*page, position).key == key) {
+        return std::make_unique<kvPair>(pageEntry(*page, position));
     }
+    return nullptr;
+}
 
-    auto fencePointersCopy = getFencePointers();
+// Read the keys at the positions [start, end) and return the number of reads. The keys of a columnar page are stored
+// together, so there is one read for every page the positions span. Otherwise the pairs are read and their keys kept.
+size_t Run::readKeys(std::ifstream& ifs, size_t start, size_t end, std::vector<KEY_t>& keys) {
+    keys.resize(end - start);
+    if (!hasColumnarPages) {
+        std::vector<kvPair> pairs(end - start);
+        ifs.seekg(start * sizeof(kvPair), std::ios::beg);
+        ifs.read(reinterpret_cast<char*>(pairs.data()), sizeof(kvPair) * pairs.size());
+        std::transform(pairs.begin(), pairs.end(), keys.begin(), [](const kvPair &kv) { return kv.key; });
+        return 1;
+    }
+    size_t reads = 0;
+    for (size_t position = start; position < end; reads++) {
+        size_t stop = std::min(end, (position / getpagesize() + 1) * getpagesize());
+        ifs.seekg(getKeyOffset(position), std::ios::beg);
+        ifs.read(reinterpret_cast<char*>(keys.data() + (position - start)), sizeof(KEY_t) * (stop - position));
+        position = stop;
+    }
+    return reads;
+}
 
-    // Check if the specified range is outside the range of keys in the run. If so, return an empty result set.
-    if (end <= fencePointersCopy.front() || start > getMaxKey()) {
-        return rangeVec;
+// Read the values at the positions [start, end), which lie in one page
+void Run::readValues(std::ifstream& ifs, size_t start, size_t end, std::vector<VAL_t>& values) {
+    values.resize(end - start);
+    if (!hasColumnarPages) {
+        std::vector<kvPair> pairs(end - start);
+        ifs.seekg(start * sizeof(kvPair), std::ios::beg);
+        ifs.read(reinterpret_cast<char*>(pairs.data()), sizeof(kvPair) * pairs.size());
+        std::transform(pairs.begin(), pairs.end(), values.begin(), [](const kvPair &kv) { return kv.value; });
+        return;
     }
+    ifs.seekg(getValueOffset(start), std::ios::beg);
+    ifs.read(reinterpret_cast<char*>(values.data()), sizeof(VAL_t) * values.size());
+}
 
-    // Use binary search to identify the starting fence pointer index where the start key might be located.
-    auto iterStart = std::upper_bound(fencePointersCopy.begin(), fencePointersCopy.end(), start);
-    searchPageStart = std::distance(fencePointersCopy.begin(), iterStart) - 1;
+// Read the pairs at the positions [start, end) with a single read. In a columnar page, whose positions must lie in that
+// one page, the read spans from the first key to the last value, which is the rest of the page's keys and the values
+// before the last position. For a few positions this is still cheaper than a second read for their values.
+void Run::readPairs(std::ifstream& ifs, size_t start, size_t end, std::vector<kvPair>& pairs) {
+    pairs.resize(end - start);
+    if (!hasColumnarPages) {
+        ifs.seekg(start * sizeof(kvPair), std::ios::beg);
+        ifs.read(reinterpret_cast<char*>(pairs.data()), sizeof(kvPair) * pairs.size());
+        return;
+    }
+    size_t keyOffset = getKeyOffset(start);
+    size_t valueOffset = getValueOffset(start);
+    std::vector<char> span(getValueOffset(end - 1) + sizeof(VAL_t) - keyOffset);
+    ifs.seekg(keyOffset, std::ios::beg);
+    ifs.read(span.data(), span.size());
+    const KEY_t *keys = reinterpret_cast<const KEY_t*>(span.data());
+    const VAL_t *values = reinterpret_cast<const VAL_t*>(span.data() + (valueOffset - keyOffset));
+    for (size_t i = 0; i < pairs.size(); i++) {
+        pairs[i] = {keys[i], values[i]};
+    }
+}
+
+// Return the number of pairs in a page. Every page but the last is full.
+size_t Run::getPageEntries(size_t pageIndex) const {
+    return (pageIndex + 1 == fenceIndex.size()) ? size - pageIndex * getpagesize() : getpagesize();
+}
+
+// Return the offset in the run file of the key at a position
+size_t Run::getKeyOffset(size_t position) const {
+    if (!hasColumnarPages) {
+        return position * sizeof(kvPair);
+    }
+    size_t pageStart = position / getpagesize() * getpagesize();
+    return pageStart * sizeof(kvPair) + (position - pageStart) * sizeof(KEY_t);
+}
 
+// Return the offset in the run file of the value at a position, which in a columnar page follows all the page's keys
+size_t Run::getValueOffset(size_t position) const {
+    if (!hasColumnarPages) {
+        return position * sizeof(kvPair) + offsetof(kvPair, value);
+    }
+    size_t pageIndex = position / getpagesize();
+    size_t pageStart = pageIndex * getpagesize();
+    return pageStart * sizeof(kvPair) + getPageEntries(pageIndex) * sizeof(KEY_t) + (position - pageStart) * sizeof(VAL_t);
+}
+
+// Record whether a key that passed the Bloom filter was found in the run
+void Run::countFilterPositive(bool found) {
+    if (found) {
+        lsmTree->incrementBfTruePositives(levelOfRun);
+        incrementTruePositives();
+    } else {
+        lsmTree->incrementBfFalsePositives(levelOfRun);
+        incrementFalsePositives();
+    }
+}
+
+// Search the run file for the key, which has already passed the Bloom filter
+std::unique_ptr<VAL_t> Run::readValue(KEY_t key) {
+    std::ifstream ifs;
     // Start the timer for the query
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    size_t pageStart = searchPageStart * getpagesize();
-    size_t pageEnd = (searchPageStart + 1 == fencePointersCopy.size()) ? runSize : (searchPageStart + 1) * getpagesize();
+    std::unique_ptr<kvPair> kv;
+    bool read = true;
+    if (lsmTree->getBlockCache().getCapacity() > 0) {
+        // With a block cache, a page is read whole once and searched in memory while it stays cached
+        kv = searchPage(ifs, key, read);
+        closeInputFileStream(ifs);
+    } else {
+        openInputFileStream(ifs, "Run::get: Failed to open file for Run");
+        kv = hasBlockHashIndex ? searchBlockHashIndex(ifs, key) : searchForKey(ifs, key).second;
+        closeInputFileStream(ifs);
+    }
+    countFilterPositive(kv != nullptr);
 
-    openInputFileStream(ifs, "Run::range: Failed to open file for Run");
-    std::pair<size_t, std::unique_ptr<kvPair>> startPosResult = binarySearchInRange(ifs, pageStart, pageEnd, start);
-    std::unique_ptr<kvPair> startPosKvPair = std::move(startPosResult.second);
+    if (read) {
+        auto end_time = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
 
-    size_t rangeStartIndex;
-    if (startPosKvPair != nullptr) {
-        rangeVec.push_back(*startPosKvPair);
-        // Start key was already found so don't need to read again
-        rangeStartIndex = startPosResult.first + 1;
-    } else {
-        // Start key was not found so read from beginning
-        rangeStartIndex = startPosResult.first;
+        lsmTree->incrementLevelIoCountAndTime(levelOfRun, duration);
     }
 
-    for (size_t i = rangeStartIndex; i < runSize; i++) {
-        kvPair kv;
-        // Read the key-value pair at index i
-        ifs.seekg(i * sizeof(kvPair), std::ios::beg);
-        ifs.read(reinterpret_cast<char*>(&kv), sizeof(kvPair));
+    return (kv == nullptr) ? nullptr : std::make_unique<VAL_t>(kv->value);
+}
 
-        if (kv.key >= start && kv.key < end) {
-            rangeVec.push_back(kv);
-        } else if (kv.key >= end) {
-            break;
+// Return the position of the key in the run and its KvPair, or the position where it would be inserted and nullptr.
+// A run with a learned index reads the window around the predicted position in a single read, together with its values
+// unless it is a wide columnar window or spans two columnar pages. Otherwise the page given by the fence index is binary
+// searched, one read per step.
+std::pair<size_t, std::unique_ptr<kvPair>> Run::searchForKey(std::ifstream &ifs, KEY_t key) {
+    if (learnedIndex.empty()) {
+        size_t pageIndex = fenceIndex.findPage(key);
+        size_t start = pageIndex * getpagesize();
+        size_t end = (pageIndex + 1 == fenceIndex.size()) ? size : (pageIndex + 1) * getpagesize();
+        return binarySearchInRange(ifs, start, end, key);
+    }
+    auto [start, end] = learnedIndex.findWindow(key);
+    if (!hasColumnarPages || (end - start <= PAIRED_READ_MAX_ENTRIES && start / getpagesize() == (end - 1) / getpagesize())) {
+        std::vector<kvPair> pairs;
+        readPairs(ifs, start, end, pairs);
+        lsmTree->recordRunSearch(levelOfRun, 1, pairs.size());
+        auto it = std::lower_bound(pairs.begin(), pairs.end(), key, [](const kvPair &kv, KEY_t k) { return kv.key < k; });
+        size_t position = start + (it - pairs.begin());
+        if (it != pairs.end() && it->key == key) {
+            return std::make_pair(position, std::make_unique<kvPair>(*it));
         }
+        return std::make_pair(position, nullptr);
     }
-    closeInputFileStream(ifs);
+    std::vector<KEY_t> window;
+    size_t reads = readKeys(ifs, start, end, window);
+
+    auto it = branchless_lower_bound(window.begin(), window.end(), key);
+    size_t position = start + (it - window.begin());
+    if (it != window.end() && *it == key) {
+        std::vector<VAL_t> value;
+        readValues(ifs, position, position + 1, value);
+        lsmTree->recordRunSearch(levelOfRun, reads + 1, window.size() + 1);
+        return std::make_pair(position, std::make_unique<kvPair>(kvPair{key, value[0]}));
+    }
+    lsmTree->recordRunSearch(levelOfRun, reads, window.size());
+    return std::make_pair(position, nullptr);
+}
 
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+// Look a key up in its page's hash index, reading the buckets in reach of its home bucket and then the pairs of those
+// tagged like the key, until one holds it. A key that may have been left out of the index is searched for as usual.
+std::unique_ptr<kvPair> Run::searchBlockHashIndex(std::ifstream &ifs, KEY_t key) {
+    size_t pageIndex = fenceIndex.findPage(key);
+    size_t start = pageIndex * getpagesize();
+    size_t end = (pageIndex + 1 == fenceIndex.size()) ? size : (pageIndex + 1) * getpagesize();
+    size_t home = BlockHashIndex::getHomeBucket(key, end - start);
+
+    std::array<uint16_t, BLOCK_HASH_INDEX_PROBE_BUCKETS> buckets;
+    ifs.seekg(getBlockHashIndexOffset(pageIndex) + home * sizeof(uint16_t), std::ios::beg);
+    ifs.read(reinterpret_cast<char*>(buckets.data()), sizeof(buckets));
+    size_t reads = 1;
+    uint16_t tag = BlockHashIndex::getTag(key);
+    for (uint16_t bucket : buckets) {
+        // Had the key been in the index, it would be in a bucket before the first empty one
+        if (bucket == BLOCK_HASH_INDEX_EMPTY) {
+            lsmTree->recordRunSearch(levelOfRun, reads, reads - 1);
+            return nullptr;
+        }
+        if (!BlockHashIndex::matches(bucket, tag)) {
+            continue;
+        }
+        size_t slot = BlockHashIndex::getSlot(bucket);
+        std::vector<kvPair> pair;
+        readPairs(ifs, start + slot, start + slot + 1, pair);
+        reads++;
+        if (pair[0].key == key) {
+            lsmTree->recordRunSearch(levelOfRun, reads, reads - 1);
+            return std::make_unique<kvPair>(pair[0]);
+        }
+    }
+    return searchForKey(ifs, key).second;
+}
 
-    lsmTree->incrementLevelIoCountAndTime(levelOfRun, duration);
-    return rangeVec;
+// Return the offset in the run file of a page's hash index. Every page but the last is full, so the indexes before it
+// all have the same number of buckets.
+size_t Run::getBlockHashIndexOffset(size_t pageIndex) {
+    return size * sizeof(kvPair) + pageIndex * BlockHashIndex::getNumBuckets(getpagesize()) * sizeof(uint16_t);
+}
+
+// Return a pair of the position of a KvPair, and a pointer to the KvPair. The search covers the positions [start, end),
+// which lie in one page, and if the key is not found the position is where it would be inserted. A step in a columnar
+// page reads only the key at its middle, and once few positions are left they are read with their values at once.
+std::pair<size_t, std::unique_ptr<kvPair>> Run::binarySearchInRange(std::ifstream &ifs, size_t start, size_t end, KEY_t key) {
+    size_t reads = 0;
+    size_t entries = 0;
+    while (start < end) {
+        if (hasColumnarPages && end - start <= PAIRED_READ_MAX_ENTRIES) {
+            std::vector<kvPair> pairs;
+            readPairs(ifs, start, end, pairs);
+            lsmTree->recordRunSearch(levelOfRun, reads + 1, entries + pairs.size());
+            auto it = std::lower_bound(pairs.begin(), pairs.end(), key,
+                                       [](const kvPair &kv, KEY_t k) { return kv.key < k; });
+            size_t position = start + (it - pairs.begin());
+            if (it != pairs.end() && it->key == key) {
+                return std::make_pair(position, std::make_unique<kvPair>(*it));
+            }
+            return std::make_pair(position, nullptr);
+        }
+        size_t mid = start + (end - start) / 2;
+
+        // Read the pair at the mid index, or only its key in a columnar page
+        kvPair midPair;
+        if (hasColumnarPages) {
+            ifs.seekg(getKeyOffset(mid), std::ios::beg);
+            ifs.read(reinterpret_cast<char*>(&midPair.key), sizeof(KEY_t));
+        } else {
+            ifs.seekg(mid * sizeof(kvPair), std::ios::beg);
+            ifs.read(reinterpret_cast<char*>(&midPair), sizeof(kvPair));
+        }
+        reads++;
+        entries++;
+        KEY_t midKey = midPair.key;
+
+        if (midKey == key) {
+            if (hasColumnarPages) {
+                std::vector<VAL_t> value;
+                readValues(ifs, mid, mid + 1, value);
+                midPair.value = value[0];
+                reads++;
+                entries++;
+            }
+            lsmTree->recordRunSearch(levelOfRun, reads, entries);
+            return std::make_pair(mid, std::make_unique<kvPair>(midPair));
+        } else if (midKey < key) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    lsmTree->recordRunSearch(levelOfRun, reads, entries);
+    return std::make_pair(start, nullptr);
+}
+
+// Position the cursor on the first pair of the run at or after the start key
+RunCursor::RunCursor(std::shared_ptr<Run> run, KEY_t start, KEY_t end) : run(std::move(run)), end(end) {
+    if (this->run->size == 0 || end <= this->run->fenceIndex.front() || start > this->run->maxKey) {
+        pageIndex = this->run->fenceIndex.size();
+        return;
+    }
+    this->run->openInputFileStream(ifs, "RunCursor: Failed to open file for Run");
+    pageIndex = this->run->fenceIndex.findPage(start);
+    loadPage();
+    position = std::lower_bound(block.begin(), block.begin() + limit, start,
+                                [](const kvPair &kv, KEY_t k) { return kv.key < k; }) - block.begin();
+    // The start key may be past the page's last pair, in which case the range begins on the next page
+    if (position == limit && limit == block.size()) {
+        skipBlock();
+    }
+}
+
+RunCursor::~RunCursor() {
+    if (ifs.is_open()) {
+        run->closeInputFileStream(ifs);
+    }
+}
+
+// Read the current page and find where it reaches the end key
+void RunCursor::loadPage() const {
+    run->readBlock(ifs, pageIndex, block);
+    loaded = true;
+    position = 0;
+    limit = std::lower_bound(block.begin(), block.end(), end,
+                             [](const kvPair &kv, KEY_t k) { return kv.key < k; }) - block.begin();
+}
+
+// A page that is not read yet starts at its fence pointer
+bool RunCursor::valid() const {
+    if (loaded) {
+        return position < limit;
+    }
+    return pageIndex < run->fenceIndex.size() && run->fenceIndex[pageIndex] < end;
+}
+
+const kvPair& RunCursor::current() const {
+    if (!loaded) {
+        loadPage();
+    }
+    return block[position];
+}
+
+KEY_t RunCursor::currentKey() const {
+    return loaded ? block[position].key : run->fenceIndex[pageIndex];
+}
+
+// Move to the next pair, moving on to the next page once this one is used up unless the end key was already reached
+void RunCursor::next() {
+    // The merge may move past a key it only knew from the fence pointers
+    if (!loaded) {
+        loadPage();
+    }
+    position++;
+    if (position == block.size() && limit == block.size()) {
+        skipBlock();
+    }
+}
+
+// A page whose pairs the merge has not started on, and that ends before the end key, can be taken as a whole
+const BlockStats* RunCursor::blockStats() const {
+    if (run->pageStats.empty() || (loaded && position != 0)) {
+        return nullptr;
+    }
+    const BlockStats &stats = run->pageStats[pageIndex];
+    return (stats.lastKey < end) ? &stats : nullptr;
+}
+
+void RunCursor::skipBlock() {
+    pageIndex++;
+    loaded = false;
+}
+
+std::span<const kvPair> RunCursor::blockPairs() const {
+    if (!loaded) {
+        loadPage();
+    }
+    return {block.data(), limit};
+}
+
+// Append the first keys of the pages that start after the start key and before the end key
+void Run::appendFencePointers(KEY_t start, KEY_t end, std::vector<KEY_t>& keys) const {
+    auto first = std::upper_bound(fenceIndex.begin(), fenceIndex.end(), start);
+    auto last = std::lower_bound(first, fenceIndex.end(), end);
+    keys.insert(keys.end(), first, last);
+}
+
+// Estimate the pairs of the run in [start, end) from the fence pointers and page statistics. The pages in between are
+// counted whole, and the share of the first and last pages in the range is taken from their key ranges, assuming
+// their keys are spread evenly.
+RangeEstimate Run::estimateRange(KEY_t start, KEY_t end) const {
+    RangeEstimate estimate;
+    if (size == 0 || end <= fenceIndex.front() || start > maxKey) {
+        return estimate;
+    }
+    size_t firstPage = fenceIndex.findPage(start);
+    size_t lastPage = std::upper_bound(fenceIndex.begin(), fenceIndex.end(), end - 1) - fenceIndex.begin() - 1;
+    estimate.pages = lastPage - firstPage + 1;
+    for (size_t page = firstPage; page <= lastPage; page++) {
+        size_t pageEntries = std::min<size_t>(getpagesize(), size - page * getpagesize());
+        size_t pairs = pageStats.empty() ? pageEntries : pageStats[page].count;
+        size_t tombstones = pageStats.empty() ? 0 : pageStats[page].tombstones;
+        if (page != firstPage && page != lastPage) {
+            estimate.pairs += pairs;
+            estimate.tombstones += tombstones;
+            continue;
+        }
+        int64_t low = fenceIndex[page];
+        int64_t high = !pageStats.empty() ? pageStats[page].lastKey
+                       : page + 1 < fenceIndex.size() ? fenceIndex[page + 1] - 1 : maxKey;
+        int64_t overlap = std::min<int64_t>(high, end - 1) - std::max<int64_t>(low, start) + 1;
+        if (overlap > 0) {
+            double share = static_cast<double>(overlap) / (high - low + 1);
+            estimate.pairs += static_cast<size_t>(pairs * share + 0.5);
+            estimate.tombstones += static_cast<size_t>(tombstones * share + 0.5);
+        }
+    }
+    return estimate;
 }
 
 std::vector<kvPair> Run::getVector() {
@@ -293,9 +920,11 @@ std::vector<kvPair> Run::getVector() {
     // Open the file descriptor
     openInputFileStream(ifs, "Run::getVector: Failed to open file for Run");
 
-    kvPair kv;
-    while (ifs.read(reinterpret_cast<char*>(&kv), sizeof(kvPair))) {
-        vec.push_back(kv);
+    // Any block hash indexes follow the run's data
+    std::vector<kvPair> block;
+    for (size_t pageIndex = 0; pageIndex < fenceIndex.size(); pageIndex++) {
+        readPage(ifs, pageIndex, block);
+        vec.insert(vec.end(), block.begin(), block.end());
     }
     closeInputFileStream(ifs);
 
@@ -313,13 +942,29 @@ json Run::serialize() const {
     nlohmann::json j;
     j["maxKvPairs"] = maxKvPairs;
     j["bfErrorRate"] = bfErrorRate;
-    j["bloomFilter"] = bloomFilter.serialize();
-    j["fencePointers"] = fencePointers;
+    j["bloomFilter"] = bloomFilter.load()->serialize();
+    j["fencePointers"] = std::vector<KEY_t>(fenceIndex.begin(), fenceIndex.end());
+    if (!learnedIndex.empty()) {
+        j["learnedIndex"] = learnedIndex.serialize();
+    }
+    j["blockHashIndex"] = hasBlockHashIndex;
+    j["blockHashIndexProbeBuckets"] = BLOCK_HASH_INDEX_PROBE_BUCKETS;
+    j["columnarPages"] = hasColumnarPages;
+    j["pageStats"] = json::array();
+    for (const auto &stats : pageStats) {
+        j["pageStats"].push_back({stats.lastKey, stats.count, stats.sum, stats.minValue, stats.maxValue, stats.tombstones});
+    }
+    if (!keySketch.empty()) {
+        j["keySketch"] = keySketch.serialize();
+    }
+    if (!partitionedFilter.empty()) {
+        j["partitionedFilter"] = partitionedFilter.serialize();
+    }
     j["runFileName"] = runFileName;
     j["size"] = size;
     j["maxKey"] = maxKey;
-    j["truePositives"] = truePositives;
-    j["falsePositives"] = falsePositives;
+    j["truePositives"] = truePositives.load();
+    j["falsePositives"] = falsePositives.load();
     j["firstKey"] = firstKey;
     j["lastKey"] = lastKey;
     return j;
@@ -329,26 +974,51 @@ void Run::deserialize(const json& j) {
     maxKvPairs = j["maxKvPairs"];
     bfErrorRate = j["bfErrorRate"];
 
-    bloomFilter.deserialize(j["bloomFilter"]);
-    fencePointers = j["fencePointers"].get<std::vector<KEY_t>>();
+    fenceIndex = FenceIndex(j["fencePointers"].get<std::vector<KEY_t>>());
+    if (j.contains("learnedIndex")) {
+        learnedIndex.deserialize(j["learnedIndex"]);
+    }
+    // A hash index written with another layout is left unused, and the run's pages are searched until it is compacted
+    hasBlockHashIndex = j.value("blockHashIndex", false) &&
+                        j.value("blockHashIndexProbeBuckets", size_t(0)) == BLOCK_HASH_INDEX_PROBE_BUCKETS;
+    hasColumnarPages = j.value("columnarPages", false);
     runFileName = j["runFileName"];
     size = j["size"];
+    const json& filterJson = j["bloomFilter"];
+    bloomFilter.load()->deserialize(filterJson);
+    if (!filterJson.contains("numUnits")) {
+        rebuildLegacyBloomFilter();
+    }
+    setBloomFilterEnabledUnits(filterJson.value("enabledUnits", getBloomFilterNumUnits()));
+    pageStats.clear();
+    if (j.contains("pageStats")) {
+        for (const auto &stats : j["pageStats"]) {
+            // In runs written before the tombstones were counted, every pair of a page that is not counted is one
+            size_t pageStart = pageStats.size() * getpagesize();
+            size_t pageEntries = std::min<size_t>(getpagesize(), size - pageStart);
+            size_t tombstones = stats.size() > 5 ? stats[5].get<size_t>() : pageEntries - stats[1].get<size_t>();
+            pageStats.push_back({stats[0].get<KEY_t>(), stats[1].get<size_t>(), stats[2].get<int64_t>(),
+                                 stats[3].get<VAL_t>(), stats[4].get<VAL_t>(), tombstones});
+        }
+    }
+    if (j.contains("keySketch")) {
+        keySketch.deserialize(j["keySketch"]);
+    }
+    if (j.contains("partitionedFilter")) {
+        partitionedFilter.deserialize(j["partitionedFilter"]);
+    }
     maxKey = j["maxKey"];
-    truePositives = j["truePositives"];
-    falsePositives = j["falsePositives"];
+    truePositives = j["truePositives"].get<size_t>();
+    falsePositives = j["falsePositives"].get<size_t>();
     firstKey = j["firstKey"];
     lastKey = j["lastKey"];
 }
 
 float Run::getBfFalsePositiveRate() {
-    std::shared_lock<std::shared_mutex> lockFP(falsePositivesMutex, std::defer_lock);
-    std::shared_lock<std::shared_mutex> lockTP(truePositivesMutex, std::defer_lock);
-
-    std::lock(lockFP, lockTP);
-
-    int total = truePositives + falsePositives;
+    size_t fp = falsePositives.load(std::memory_order_relaxed);
+    size_t total = truePositives.load(std::memory_order_relaxed) + fp;
     if (total > 0) {
-        return (float)falsePositives / total;
+        return (float)fp / total;
     } else {
         return BLOOM_FILTER_UNUSED; // No false positives or true positives
     }
@@ -365,78 +1035,124 @@ std::map<std::string, std::string> Run::getBloomFilterSummary() {
     // If the bloom filter has not been used, don't print the false positive rate and just print "Unused"
     std::string bfStatus = getBfFalsePositiveRate() == BLOOM_FILTER_UNUSED ? "Unused" : std::to_string(getBfFalsePositiveRate());
 
-    summary["bloomFilterSize"] = addCommas(std::to_string(getBloomFilterNumBits()));
-    summary["hashFunctions"] = std::to_string(bloomFilter.getNumHashes());
+    std::shared_ptr<BloomFilter> filter = bloomFilter.load();
+    summary["bloomFilterSize"] = addCommas(std::to_string(filter->getNumBits()));
+    summary["hashFunctions"] = std::to_string(filter->getNumHashes());
+    summary["units"] = std::to_string(filter->getEnabledUnits()) + "/" + std::to_string(filter->getNumUnits());
     summary["keys"] = addCommas(std::to_string(size)) + " (Max " + addCommas(std::to_string(maxKvPairs)) + ")";
-    summary["theoreticalFPR"] = std::to_string(bloomFilter.theoreticalErrorRate());
-    summary["truePositives"] = addCommas(std::to_string(truePositives));
-    summary["falsePositives"] = addCommas(std::to_string(getFalsePositives()));
+    summary["theoreticalFPR"] = std::to_string(filter->theoreticalErrorRate());
+    if (hasPartitionedFilter()) {
+        // The filter in memory is empty, and the partitions on disk answer for the run
+        summary["bloomFilterSize"] = addCommas(std::to_string(partitionedFilter.getNumBits()));
+        summary["hashFunctions"] = std::to_string(partitionedFilter.getNumHashes());
+        summary["units"] = addCommas(std::to_string(partitionedFilter.getNumPartitions())) + " partitions";
+        summary["theoreticalFPR"] = std::to_string(bfErrorRate);
+    }
+    summary["truePositives"] = addCommas(std::to_string(truePositives.load()));
+    summary["falsePositives"] = addCommas(std::to_string(falsePositives.load()));
     summary["measuredFPR"] = bfStatus;
 
     return summary;
 }
 
-void Run::resizeBloomFilterBitset(size_t numBits) {
-    bloomFilter.resize(numBits);
-}
-
-// Populate the bloom filter. This will typically be called after MONKEY resizes them.
-void Run::populateBloomFilter() {
+// Rebuild the bloom filter with numBits bits. This will typically be called after MONKEY resizes them. The new filter
+// is built on the side by streaming the run's key fingerprints, so the Run file is never read and readers keep using
+// the old filter until the new one is swapped in.
+void Run::rebuildBloomFilter(size_t numBits) {
     if (size == 0) {
         return;
     }
-    std::ifstream ifs;
-    openInputFileStream(ifs, "Run::populateBloomFilter: Failed to open file for Run");
-    // Read all the key-value pairs from the Run file and add the keys to the bloom filter
-    kvPair kv;
-    while (ifs.read(reinterpret_cast<char*>(&kv), sizeof(kvPair))) {
-        bloomFilter.add(kv.key);
+    std::ifstream ifs(getFingerprintFilePath(), std::ios::in | std::ios::binary);
+    if (!ifs.is_open()) {
+        die("Run::rebuildBloomFilter: Failed to open fingerprint file for Run: " + getFingerprintFilePath());
     }
-    closeInputFileStream(ifs);
-}
+    std::lock_guard<std::mutex> lock(bloomFilterMutex);
+    auto rebuilt = std::make_shared<BloomFilter>(*bloomFilter.load());
+    rebuilt->resize(numBits);
+
+    std::vector<uint32_t> fingerprints(FINGERPRINT_READ_BATCH);
+    while (ifs) {
+        ifs.read(reinterpret_cast<char*>(fingerprints.data()), sizeof(uint32_t) * fingerprints.size());
+        size_t numRead = ifs.gcount() / sizeof(uint32_t);
+        for (size_t i = 0; i < numRead; i++) {
+            rebuilt->addFingerprint(fingerprints[i]);
+        }
+    }
+    ifs.close();
 
-void Run::incrementFalsePositives() { 
-    std::unique_lock<std::shared_mutex> lock(falsePositivesMutex);
-    falsePositives++;
-}
-void Run::incrementTruePositives() {
-    std::unique_lock<std::shared_mutex> lock(truePositivesMutex);
-    truePositives++; 
+    writeBloomFilterUnits(*rebuilt);
+    bloomFilter.store(std::move(rebuilt));
 }
 
-size_t Run::getFalsePositives() {
-    std::shared_lock<std::shared_mutex> lock(falsePositivesMutex);
-    return falsePositives;
+// A run saved before Bloom filters had units has no fingerprint or filter file, and its saved filter bits hashed the
+// keys themselves, so they cannot be probed with fingerprint hashes. Write the fingerprints of its keys and rebuild the
+// filter from them at the same size, as its single unit.
+void Run::rebuildLegacyBloomFilter() {
+    std::ifstream ifs;
+    openInputFileStream(ifs, "Run::rebuildLegacyBloomFilter: Failed to open file for Run");
+    std::ofstream fpOfs(getFingerprintFilePath(), std::ios::out | std::ios::binary);
+    if (!fpOfs.is_open()) {
+        die("Run::rebuildLegacyBloomFilter: Failed to open fingerprint file for Run: " + getFingerprintFilePath());
+    }
+    std::vector<kvPair> block;
+    std::vector<uint32_t> fingerprints;
+    for (size_t pageIndex = 0; pageIndex < fenceIndex.size(); pageIndex++) {
+        readPage(ifs, pageIndex, block);
+        fingerprints.clear();
+        for (const auto &kv : block) {
+            fingerprints.push_back(BloomFilter::fingerprint(kv.key));
+        }
+        fpOfs.write(reinterpret_cast<const char*>(fingerprints.data()), sizeof(uint32_t) * fingerprints.size());
+    }
+    fpOfs.close();
+    closeInputFileStream(ifs);
+    rebuildBloomFilter(bloomFilter.load()->getNumBits());
 }
 
-void Run::setSize(size_t newSize) {
-    std::unique_lock<std::shared_mutex> lock(sizeMutex);
-    size = newSize;
+// Write all the units of a fully built Bloom filter to the filter file, then free the units that are not enabled
+void Run::writeBloomFilterUnits(BloomFilter& filter) {
+    std::ofstream ofs(getBloomFilterFilePath(), std::ios::out | std::ios::binary);
+    if (!ofs.is_open()) {
+        die("Run::writeBloomFilterUnits: Failed to open filter file for Run: " + getBloomFilterFilePath());
+    }
+    filter.writeUnits(ofs);
+    ofs.close();
+    filter.trimUnits();
 }
 
-void Run::setMaxKey(KEY_t key) {
-    std::unique_lock<std::shared_mutex> lock(maxKeyMutex);
-    maxKey = key;
+size_t Run::getBloomFilterEnabledUnits() {
+    return bloomFilter.load()->getEnabledUnits();
 }
 
-KEY_t Run::getMaxKey() {
-    std::shared_lock<std::shared_mutex> lock(maxKeyMutex);
-    return maxKey;
+// Enable the first enabledUnits Bloom filter units, loading them from the filter file if they are not resident.
+// The change is made on a copy that then replaces the filter, so readers never see a partially loaded filter.
+void Run::setBloomFilterEnabledUnits(size_t enabledUnits) {
+    std::ifstream ifs(getBloomFilterFilePath(), std::ios::in | std::ios::binary);
+    if (!ifs.is_open()) {
+        die("Run::setBloomFilterEnabledUnits: Failed to open filter file for Run: " + getBloomFilterFilePath());
+    }
+    std::lock_guard<std::mutex> lock(bloomFilterMutex);
+    auto updated = std::make_shared<BloomFilter>(*bloomFilter.load());
+    updated->setEnabledUnits(enabledUnits, ifs);
+    bloomFilter.store(std::move(updated));
 }
 
-void Run::addFencePointer(KEY_t key) {
-    std::unique_lock<std::shared_mutex> lock(fencePointersMutex);
-    fencePointers.push_back(key);
+// MONKEY uses the filter's bit count as scratch space while it searches for an allocation. Readers only use the
+// filter's units, so the count is updated in place.
+void Run::setBloomFilterNumBits(size_t numBits) {
+    std::lock_guard<std::mutex> lock(bloomFilterMutex);
+    bloomFilter.load()->setNumBits(numBits);
 }
 
-std::vector<KEY_t> Run::getFencePointers() {
-    std::shared_lock<std::shared_mutex> lock(fencePointersMutex);
-    return fencePointers;
+// Fold the probes since the last call into the run's decayed access frequency and return it
+double Run::updateAccessFrequency() {
+    accessFrequency = accessFrequency * BLOOM_TUNER_DECAY + bloomFilterProbes.exchange(0, std::memory_order_relaxed);
+    return accessFrequency;
 }
 
-void Run::addToBloomFilter(KEY_t key) {
-    std::unique_lock<std::shared_mutex> lock(bloomFilterMutex);
-    bloomFilter.add(key);
+void Run::incrementFalsePositives() { 
+    falsePositives.fetch_add(1, std::memory_order_relaxed);
+}
+void Run::incrementTruePositives() {
+    truePositives.fetch_add(1, std::memory_order_relaxed);
 }
-
-
@@ -4,8 +4,19 @@
 #include <string>
 #include <shared_mutex>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <tuple>
 #include "memtable.hpp"
 #include "bloom_filter.hpp"
+#include "fence_index.hpp"
+#include "learned_index.hpp"
+#include "key_sketch.hpp"
+#include "partitioned_filter.hpp"
+#include "block_cache.hpp"
+#include "interleaved_lookup.hpp"
+#include "merge_iterator.hpp"
 
 class LSMTree;
 
@@ -14,7 +25,10 @@ public:
     Run(size_t maxKvPairs, double bfErrorRate, bool createFile, size_t levelOfRun, LSMTree* lsmTree);
     ~Run();
     std::unique_ptr<VAL_t> get(KEY_t key);
-    std::vector<kvPair> range(KEY_t start, KEY_t end);
+    bool mayContain(KEY_t key);
+    std::unique_ptr<VAL_t> readValue(KEY_t key);
+    void getBatch(const std::vector<KEY_t>& keys, const std::vector<KeyHash>& hashes,
+                  std::vector<std::unique_ptr<VAL_t>>& values);
     void flush(std::unique_ptr<std::vector<kvPair>> kvPairs);
     std::vector<kvPair> getVector();
     size_t getMaxKvPairs();
@@ -27,47 +41,128 @@ public:
     json serialize() const;
     void deserialize(const json& j);
     void deleteFile();
+    void markObsolete() { obsolete = true; }
     void setLSMTree(LSMTree* lsmTree);
-    size_t getBloomFilterNumBits() { return bloomFilter.getNumBits(); }
-    void setBloomFilterNumBits(size_t numBits) { bloomFilter.setNumBits(numBits); }
+    size_t getBloomFilterNumBits() { return bloomFilter.load()->getNumBits(); }
+    void setBloomFilterNumBits(size_t numBits);
     size_t getSize() { return size; }
-    void resizeBloomFilterBitset(size_t numBits);
-    void populateBloomFilter();
+    void rebuildBloomFilter(size_t numBits);
     std::string getRunFilePath();
+    std::string getBloomFilterFilePath();
+    std::string getFingerprintFilePath();
+    std::string getPartitionedFilterFilePath();
+    bool hasPartitionedFilter() const { return !partitionedFilter.empty(); }
+
+    // Elastic Bloom filter units
+    size_t getBloomFilterNumUnits() { return bloomFilter.load()->getNumUnits(); }
+    size_t getBloomFilterUnitBits() { return bloomFilter.load()->getUnitBits(); }
+    double getBloomFilterUnitErrorRate() { return bloomFilter.load()->unitErrorRate(); }
+    size_t getBloomFilterEnabledUnits();
+    void setBloomFilterEnabledUnits(size_t enabledUnits);
+    double updateAccessFrequency();
     void setFirstAndLastKeys(KEY_t first, KEY_t last);
     KEY_t getFirstKey() { return firstKey; }
     KEY_t getLastKey() { return lastKey; }
+    std::pair<KEY_t, KEY_t> getKeyRange() const { return {fenceIndex.front(), maxKey}; }
+    void appendFencePointers(KEY_t start, KEY_t end, std::vector<KEY_t>& keys) const;
+    RangeEstimate estimateRange(KEY_t start, KEY_t end) const;
+    const KeySketch& getKeySketch() const { return keySketch; }
+    const PartitionedFilter& getPartitionedFilter() const { return partitionedFilter; }
+
+    // Index memory
+    size_t getFenceIndexBytes() const { return fenceIndex.getMemoryBytes(); }
+    size_t getLearnedIndexBytes() const { return learnedIndex.getMemoryBytes(); }
+    size_t getLearnedIndexSegments() const { return learnedIndex.getNumSegments(); }
 
 private:
+    friend class RunCursor;
     std::pair<size_t, std::unique_ptr<kvPair>> binarySearchInRange(std::ifstream &ifs, size_t start, size_t end, KEY_t key);
+    std::pair<size_t, std::unique_ptr<kvPair>> searchForKey(std::ifstream &ifs, KEY_t key);
+    std::unique_ptr<kvPair> searchBlockHashIndex(std::ifstream &ifs, KEY_t key);
+    size_t getBlockHashIndexOffset(size_t pageIndex);
+    size_t getPageEntries(size_t pageIndex) const;
+    size_t getKeyOffset(size_t position) const;
+    size_t getValueOffset(size_t position) const;
+    void readBlock(std::ifstream& ifs, size_t pageIndex, std::vector<kvPair>& block);
+    void readPage(std::ifstream& ifs, size_t pageIndex, std::vector<kvPair>& block);
+    std::vector<char> readPageBytes(std::ifstream& ifs, size_t pageIndex);
+    BlockCache::Block getPage(std::ifstream& ifs, size_t pageIndex, bool& read, bool fillCache = true);
+    void pagePairs(const std::vector<char>& page, std::vector<kvPair>& block) const;
+    size_t pageLowerBound(const std::vector<char>& page, KEY_t key) const;
+    kvPair pageEntry(const std::vector<char>& page, size_t position) const;
+    std::unique_ptr<kvPair> searchPage(std::ifstream& ifs, KEY_t key, bool& read);
+    bool partitionContains(size_t pageIndex, const KeyHash& hash);
+    size_t readKeys(std::ifstream& ifs, size_t start, size_t end, std::vector<KEY_t>& keys);
+    void readValues(std::ifstream& ifs, size_t start, size_t end, std::vector<VAL_t>& values);
+    void readPairs(std::ifstream& ifs, size_t start, size_t end, std::vector<kvPair>& pairs);
+    void readPageValues(size_t pageIndex, std::vector<std::tuple<size_t, KEY_t, size_t>>::const_iterator first,
+                        std::vector<std::tuple<size_t, KEY_t, size_t>>::const_iterator last,
+                        std::vector<std::unique_ptr<VAL_t>>& values);
+    InterleavedLookup<std::optional<size_t>> locatePage(KEY_t key, KeyHash hash, const BloomFilter* filter);
+    void countFilterPositive(bool found);
     size_t maxKvPairs;
     double bfErrorRate;
-    std::vector<KEY_t> fencePointers;
+    FenceIndex fenceIndex; // The fence pointers and their search structure, built once they are final
+    LearnedIndex learnedIndex; // Empty unless the tree builds learned indexes, in which case it replaces the fence search
+    bool hasBlockHashIndex = false; // Whether every page's hash index follows the data in the run file
+    bool hasColumnarPages = false;  // Whether every page holds its keys and then its values, instead of key-value pairs
+    std::vector<BlockStats> pageStats; // Empty for runs written before pages had statistics
+    KeySketch keySketch; // Empty for runs written before runs had sketches
+    // Empty unless the tree partitions filters, in which case the run's filter in memory has no bits
+    PartitionedFilter partitionedFilter;
+    uint64_t dataFileId = BlockCache::newFileId();   // Id of the run file in the block cache
+    uint64_t filterFileId = BlockCache::newFileId(); // Id of the partition file in the block cache
     float getBfFalsePositiveRate();
-    size_t falsePositives = 0;
-    size_t truePositives = 0;
+    std::atomic<size_t> falsePositives{0};
+    std::atomic<size_t> truePositives{0};
     size_t levelOfRun;
     LSMTree* lsmTree;
-    BloomFilter bloomFilter;
+    // The filter is replaced as a whole, never modified in place, once the run is visible to readers
+    std::atomic<std::shared_ptr<BloomFilter>> bloomFilter;
+    std::mutex bloomFilterMutex; // Serializes the writers replacing the filter
     std::string runFileName;
+    // The size, fence pointers, indexes and max key are only written by flush() and deserialize(), before the run is published
+    // in a tree version, so readers use them without locking
     size_t size;
     KEY_t maxKey;
-    mutable std::shared_mutex falsePositivesMutex;
-    mutable std::shared_mutex truePositivesMutex;
-    mutable std::shared_mutex sizeMutex;
-    mutable std::shared_mutex maxKeyMutex;
-    mutable std::shared_mutex fencePointersMutex;
-    mutable std::shared_mutex bloomFilterMutex;
-    void setSize(size_t newSize);
-    void setMaxKey(KEY_t key);
-    KEY_t getMaxKey();
-    void addFencePointer(KEY_t key);
-    std::vector<KEY_t> getFencePointers();
-    void addToBloomFilter(KEY_t key);
+    std::atomic<bool> obsolete{false}; // Replaced by compaction. The files are deleted once no version uses the run.
+    void writeBloomFilterUnits(BloomFilter& filter);
+    void rebuildLegacyBloomFilter();
+    std::atomic<size_t> bloomFilterProbes{0}; // Filter probes since the tuner last looked at this run
+    double accessFrequency = 0;               // Decayed probe count, only touched by the Bloom filter tuner
     void incrementFalsePositives();
-    size_t getFalsePositives();
     void incrementTruePositives();
     KEY_t firstKey;
     KEY_t lastKey;
 
 };
+
+// Reads the pairs of a run in [start, end) one page at a time, so a range holds a single page of each run in memory.
+// A page is only read once the merge needs one of its pairs, since its first key is known from the fence pointers, and
+// a page the merge takes as a whole from its statistics is never read. The cursor shares ownership of the run, which
+// keeps its file until the cursor is done with it.
+class RunCursor : public MergeCursor {
+public:
+    RunCursor(std::shared_ptr<Run> run, KEY_t start, KEY_t end);
+    ~RunCursor();
+
+    bool valid() const override;
+    const kvPair& current() const override;
+    void next() override;
+    KEY_t currentKey() const override;
+    const BlockStats* blockStats() const override;
+    void skipBlock() override;
+    std::span<const kvPair> blockPairs() const override;
+
+private:
+    std::shared_ptr<Run> run;
+    KEY_t end;
+    size_t pageIndex = 0;
+    // The page being merged, read on demand
+    mutable std::ifstream ifs;
+    mutable std::vector<kvPair> block;
+    mutable bool loaded = false;
+    mutable size_t position = 0; // Position of the current pair in the page
+    mutable size_t limit = 0;    // Position of the first pair of the page at or past the end key
+    void loadPage() const;
+};
@@ -0,0 +1,108 @@
+#include <algorithm>
+#include "run_interval_index.hpp"
+#include "run.hpp"
+
+RunIntervalIndex::RunIntervalIndex(const std::vector<std::shared_ptr<Run>>& runs) {
+    for (size_t r = 0; r < runs.size(); r++) {
+        // An empty run holds no keys, so no query visits it
+        if (runs[r]->getSize() == 0) {
+            continue;
+        }
+        auto [firstKey, lastKey] = runs[r]->getKeyRange();
+        intervals.push_back({firstKey, lastKey, lastKey, r});
+    }
+    std::sort(intervals.begin(), intervals.end(),
+              [](const Interval &a, const Interval &b) { return a.firstKey < b.firstKey; });
+    for (size_t i = 1; i < intervals.size(); i++) {
+        if (intervals[i].firstKey <= intervals[i - 1].lastKey) {
+            disjoint = false;
+            break;
+        }
+    }
+    if (!disjoint) {
+        buildTree();
+    }
+}
+
+// Fill in the largest last key of every subtree. The node at sorted position i is on the level given by the number of
+// trailing one bits of i, and its children are half a subtree width to each side. Positions past the end are missing
+// nodes, whose subtrees take the largest last key of the last node that exists on the level below.
+void RunIntervalIndex::buildTree() {
+    size_t n = intervals.size();
+    size_t lastIndex = 0;
+    KEY_t last = KEY_MIN;
+    for (size_t i = 0; i < n; i += 2) {
+        lastIndex = i;
+        last = intervals[i].maxLastKey = intervals[i].lastKey;
+    }
+    int height = 1;
+    for (; (size_t(1) << height) <= n; height++) {
+        size_t halfWidth = size_t(1) << (height - 1);
+        for (size_t i = (halfWidth << 1) - 1; i < n; i += halfWidth << 2) {
+            KEY_t left = intervals[i - halfWidth].maxLastKey;
+            KEY_t right = (i + halfWidth < n) ? intervals[i + halfWidth].maxLastKey : last;
+            intervals[i].maxLastKey = std::max({intervals[i].lastKey, left, right});
+        }
+        // Move to the parent of the last node
+        lastIndex = ((lastIndex >> height) & 1) ? lastIndex - halfWidth : lastIndex + halfWidth;
+        if (lastIndex < n && intervals[lastIndex].maxLastKey > last) {
+            last = intervals[lastIndex].maxLastKey;
+        }
+    }
+    treeHeight = height - 1;
+}
+
+// Return the positions in the level of the runs whose key range intersects [low, high], newest first
+std::vector<size_t> RunIntervalIndex::findRuns(KEY_t low, KEY_t high) const {
+    std::vector<size_t> runIndices;
+    if (disjoint) {
+        // The last keys are sorted as well, so the first range that ends at or after low is found by binary search
+        auto it = std::lower_bound(intervals.begin(), intervals.end(), low,
+                                   [](const Interval &interval, KEY_t key) { return interval.lastKey < key; });
+        for (; it != intervals.end() && it->firstKey <= high; it++) {
+            runIndices.push_back(it->runIndex);
+        }
+    } else {
+        findInTree(low, high, runIndices);
+    }
+    std::sort(runIndices.begin(), runIndices.end());
+    return runIndices;
+}
+
+// Walk the interval tree from the root, skipping left subtrees that end before low and stopping at nodes that start
+// after high. Subtrees of at most RUN_INTERVAL_INDEX_SCAN_HEIGHT levels are scanned in sorted order instead.
+void RunIntervalIndex::findInTree(KEY_t low, KEY_t high, std::vector<size_t>& runIndices) const {
+    struct Frame {
+        size_t node;
+        int height;
+        bool leftDone;
+    };
+    size_t n = intervals.size();
+    std::vector<Frame> stack;
+    stack.push_back({(size_t(1) << treeHeight) - 1, treeHeight, false});
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        stack.pop_back();
+        if (frame.height <= RUN_INTERVAL_INDEX_SCAN_HEIGHT) {
+            size_t first = frame.node >> frame.height << frame.height;
+            size_t end = std::min(first + (size_t(1) << (frame.height + 1)) - 1, n);
+            for (size_t i = first; i < end && intervals[i].firstKey <= high; i++) {
+                if (intervals[i].lastKey >= low) {
+                    runIndices.push_back(intervals[i].runIndex);
+                }
+            }
+        } else if (!frame.leftDone) {
+            size_t halfWidth = size_t(1) << (frame.height - 1);
+            stack.push_back({frame.node, frame.height, true});
+            size_t left = frame.node - halfWidth;
+            if (left >= n || intervals[left].maxLastKey >= low) {
+                stack.push_back({left, frame.height - 1, false});
+            }
+        } else if (frame.node < n && intervals[frame.node].firstKey <= high) {
+            if (intervals[frame.node].lastKey >= low) {
+                runIndices.push_back(intervals[frame.node].runIndex);
+            }
+            stack.push_back({frame.node + (size_t(1) << (frame.height - 1)), frame.height - 1, false});
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include "data_types.hpp"
+
+class Run;
+
+// An index over the key ranges of a level's runs, built with every tree version, so gets and ranges only visit the
+// runs whose keys span the query. Ranges that do not overlap, as on leveled levels, are kept sorted and searched with
+// a binary search. Overlapping ranges, as on tiered and partially compacted levels, form an implicit interval tree: the
+// ranges sorted by first key are the in-order layout of a complete binary tree, and every node holds the largest last
+// key of its subtree, so a query skips the subtrees that end before it.
+class RunIntervalIndex {
+public:
+    RunIntervalIndex() = default;
+    explicit RunIntervalIndex(const std::vector<std::shared_ptr<Run>>& runs);
+
+    std::vector<size_t> findRuns(KEY_t low, KEY_t high) const;
+    bool isDisjoint() const { return disjoint; }
+
+private:
+    struct Interval {
+        KEY_t firstKey;
+        KEY_t lastKey;
+        KEY_t maxLastKey;  // Largest last key of the node's subtree
+        size_t runIndex;   // Position of the run in the level, newest first
+    };
+    std::vector<Interval> intervals; // Sorted by first key
+    bool disjoint = true;
+    int treeHeight = 0;
+    void buildTree();
+    void findInTree(KEY_t low, KEY_t high, std::vector<size_t>& runIndices) const;
+};
@@ -6,6 +6,8 @@
 #include <sys/select.h>
 #include <atomic>
 #include <string>
+#include <cctype>
+#include <algorithm>
 #include "server.hpp"
 #include "utils.hpp"
 
@@ -80,7 +82,7 @@ void Server::listenToStdIn() {
             } else if (input == "help") {
                 SyncedCout() << "bloom: Print Bloom Filter summary" << std::endl;
                 SyncedCout() << "monkey: Optimize Bloom Filters using MONKEY" << std::endl;
-                SyncedCout() << "misses: Print hits and misses stats" << std::endl;
+                SyncedCout() << "misses: Print hits and misses stats, and the row cache hit rate" << std::endl;
                 SyncedCout() << "io: Print level IO count" << std::endl;
                 SyncedCout() << "quit: Quit server" << std::endl;
                 SyncedCout() << "qs: Save server to disk and quit" << std::endl;
@@ -124,6 +126,7 @@ void Server::handleClient(int clientSocket) {
         handleCommand(ss, clientSocket);
     }
     // Clean up resources
+    closeRangeCursors(clientSocket);
     ::close(clientSocket);
     // Remove client from connected clients set
     {
@@ -134,16 +137,237 @@ void Server::handleClient(int clientSocket) {
 }
 
 void Server::sendResponse(int clientSocket, const std::string &response) {
-    for (size_t i = 0; i < response.length(); i += BUFFER_SIZE) {
-        char chunk[BUFFER_SIZE] = {};
-        std::strncpy(chunk, response.c_str() + i, BUFFER_SIZE - 1); // Subtracts 1 from BUFFER_SIZE to make sure the string is null-terminated
-        send(clientSocket, chunk, strlen(chunk), 0);
-    }
+    sendData(clientSocket, response);
     // Send the end of message indicator
-    send(clientSocket, END_OF_MESSAGE.c_str(), strlen(END_OF_MESSAGE.c_str()), 0);
+    sendData(clientSocket, END_OF_MESSAGE);
+}
+
+// Send all of the data, which a single send may only do in part. Returns false if the client is gone.
+bool Server::sendData(int clientSocket, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.length()) {
+        ssize_t n_sent = send(clientSocket, data.data() + sent, data.length() - sent, 0);
+        if (n_sent <= 0) {
+            return false;
+        }
+        sent += n_sent;
+    }
+    return true;
+}
+
+// Return a callback that appends the pairs of a range to the response as key:value separated by spaces, and sends the
+// response in batches of RANGE_STREAM_BATCH_SIZE bytes, so a large range goes out while it is still being merged. The
+// scan stops if the client is gone.
+RangeCallback Server::streamPairs(int clientSocket, std::string &response) {
+    return [this, clientSocket, &response](const kvPair &kv) {
+        response += std::to_string(kv.key) + ":" + std::to_string(kv.value) + " ";
+        if (response.length() < RANGE_STREAM_BATCH_SIZE) {
+            return true;
+        }
+        bool sent = sendData(clientSocket, response);
+        response.clear();
+        return sent;
+    };
+}
+
+// Open a cursor over a range for "rc [start] [end] [limit]" and return its id, or NO_VALUE if the range is empty.
+// Every cursor keeps run files open and its version alive, so a client may only hold MAX_RANGE_CURSORS_PER_CLIENT.
+std::string Server::openRangeCursor(std::stringstream& ss, int clientSocket) {
+    KEY_t start, end;
+    ssize_t limit;
+    ss >> start >> end >> limit;
+    // Return the help if start, end and limit are not numbers or the limit is not positive
+    if (ss.fail() || limit <= 0) {
+        return printDSLHelp();
+    }
+    {
+        // Only this client's thread opens its cursors, so the count cannot grow before the new one is added
+        std::lock_guard<std::mutex> lock(rangeCursorsMutex);
+        size_t openCursors = std::count_if(rangeCursors.begin(), rangeCursors.end(),
+            [clientSocket](const auto &entry) { return entry.second.clientSocket == clientSocket; });
+        if (openCursors >= MAX_RANGE_CURSORS_PER_CLIENT) {
+            return "ERROR: Too many open range cursors, at most " + std::to_string(MAX_RANGE_CURSORS_PER_CLIENT) + "\n";
+        }
+    }
+    std::unique_ptr<RangeCursor> cursor = lsmTree->openRangeCursor(start, end);
+    if (cursor == nullptr) {
+        return NO_VALUE;
+    }
+    std::lock_guard<std::mutex> lock(rangeCursorsMutex);
+    uint64_t cursorId = nextRangeCursorId++;
+    rangeCursors[cursorId] = {std::move(cursor), static_cast<size_t>(limit), clientSocket};
+    return std::to_string(cursorId);
+}
+
+// Stream the next batch of a range cursor for "rn [cursor]". Once the range is used up the cursor is closed, and the
+// first batch after the last pair is NO_VALUE.
+void Server::readRangeCursor(std::stringstream& ss, int clientSocket, std::string &response) {
+    uint64_t cursorId;
+    ss >> cursorId;
+    // Return the help if the cursor id is not a number
+    if (ss.fail()) {
+        response = printDSLHelp();
+        return;
+    }
+    ClientRangeCursor* entry = nullptr;
+    {
+        // Only the client that opened the cursor uses or closes it, so it stays valid once the lock is released
+        std::lock_guard<std::mutex> lock(rangeCursorsMutex);
+        auto it = rangeCursors.find(cursorId);
+        if (it != rangeCursors.end() && it->second.clientSocket == clientSocket) {
+            entry = &it->second;
+        }
+    }
+    if (entry == nullptr) {
+        response = "ERROR: No range cursor " + std::to_string(cursorId) + "\n";
+        return;
+    }
+    size_t count = 0;
+    if (entry->cursor != nullptr) {
+        count = lsmTree->readRangeCursor(*entry->cursor, entry->limit, streamPairs(clientSocket, response));
+        // Release the version and the run files as soon as the range is used up
+        if (entry->cursor->exhausted()) {
+            entry->cursor.reset();
+        }
+    }
+    if (count == 0) {
+        response = NO_VALUE;
+        std::lock_guard<std::mutex> lock(rangeCursorsMutex);
+        rangeCursors.erase(cursorId);
+    }
+}
+
+// Stream the first pairs of a range for "rl [start] [limit] [optional end]". Without an end key, the range runs to the
+// end of the key space, and the merge stops reading runs once it has the limit.
+void Server::limitRange(std::stringstream& ss, int clientSocket, std::string &response) {
+    KEY_t start, end;
+    ssize_t limit;
+    ss >> start >> limit;
+    // Return the help if start and limit are not numbers or the limit is not positive
+    if (ss.fail() || limit <= 0) {
+        response = printDSLHelp();
+        return;
+    }
+    if (!(ss >> end)) {
+        end = KEY_MAX;
+    }
+    if (lsmTree->scanRange(start, end, static_cast<size_t>(limit), streamPairs(clientSocket, response)) == 0) {
+        response = NO_VALUE;
+    }
+}
+
+// Stream the pairs of a range whose value satisfies a comparison for "rv [start] [end] [>|>=|<|<=|=] [value] [optional
+// snapshot]". The comparison becomes a range of values, which lets the tree skip the pages whose values all miss it.
+void Server::filterRange(std::stringstream& ss, int clientSocket, std::string &response) {
+    KEY_t start, end;
+    std::string comparison;
+    int64_t operand;
+    uint64_t sequenceNumber;
+    ss >> start >> end >> comparison >> operand;
+    // Return the help if the keys and the operand are not numbers or the comparison is unknown
+    if (ss.fail() || operand < VAL_MIN || operand > VAL_MAX) {
+        response = printDSLHelp();
+        return;
+    }
+    int64_t low = VAL_MIN;
+    int64_t high = VAL_MAX;
+    if (comparison == ">") {
+        low = operand + 1;
+    } else if (comparison == ">=") {
+        low = operand;
+    } else if (comparison == "<") {
+        high = operand - 1;
+    } else if (comparison == "<=") {
+        high = operand;
+    } else if (comparison == "=") {
+        low = high = operand;
+    } else {
+        response = printDSLHelp();
+        return;
+    }
+    size_t count = 0;
+    // An optional sequence number filters the range as of that snapshot
+    if (ss >> sequenceNumber) {
+        std::shared_ptr<const TreeVersion> snapshot = lsmTree->getSnapshot(sequenceNumber);
+        if (snapshot == nullptr) {
+            response = "ERROR: No snapshot at sequence number " + std::to_string(sequenceNumber) + "\n";
+            return;
+        }
+        if (low <= high) {
+            count = lsmTree->filterRange(start, end, low, high, *snapshot, streamPairs(clientSocket, response));
+        }
+    } else if (low <= high) {
+        count = lsmTree->filterRange(start, end, low, high, streamPairs(clientSocket, response));
+    }
+    if (count == 0) {
+        response = NO_VALUE;
+    }
+}
 
+// Estimate the pairs and bytes of a range for "re [start] [end]" without reading it
+std::string Server::estimateRange(std::stringstream& ss) {
+    KEY_t start, end;
+    ss >> start >> end;
+    // Return the help if start and end are not numbers
+    if (ss.fail()) {
+        return printDSLHelp();
+    }
+    RangeEstimate estimate = lsmTree->estimateRange(start, end);
+    return std::to_string(estimate.pairs) + " " + std::to_string(estimate.bytes());
 }
 
+// Release the snapshot named by the sequence number of "release [snapshot]" or "x [snapshot]"
+std::string Server::releaseSnapshot(std::stringstream& ss) {
+    uint64_t sequenceNumber;
+    ss >> sequenceNumber;
+    // Return the help if the sequence number is not a number
+    if (ss.fail()) {
+        return printDSLHelp();
+    }
+    if (!lsmTree->releaseSnapshot(sequenceNumber)) {
+        return "ERROR: No snapshot at sequence number " + std::to_string(sequenceNumber) + "\n";
+    }
+    return OK;
+}
+
+// Aggregate the live values of a range for "r<aggregate> [start] [end] [optional snapshot]" inside the tree. The minimum
+// and maximum of a range with no values are NO_VALUE.
+std::string Server::aggregateRange(const std::string& aggregate, std::stringstream& ss) {
+    KEY_t start, end;
+    uint64_t sequenceNumber;
+    ss >> start >> end;
+    // Return the help if start and end are not numbers
+    if (ss.fail()) {
+        return printDSLHelp();
+    }
+    RangeAggregate result;
+    // An optional sequence number aggregates the range as of that snapshot
+    if (ss >> sequenceNumber) {
+        std::shared_ptr<const TreeVersion> snapshot = lsmTree->getSnapshot(sequenceNumber);
+        if (snapshot == nullptr) {
+            return "ERROR: No snapshot at sequence number " + std::to_string(sequenceNumber) + "\n";
+        }
+        result = lsmTree->aggregateRange(start, end, *snapshot);
+    } else {
+        result = lsmTree->aggregateRange(start, end);
+    }
+    if (aggregate == "count") {
+        return std::to_string(result.count);
+    }
+    if (aggregate == "sum") {
+        return std::to_string(result.sum);
+    }
+    if (result.count == 0) {
+        return NO_VALUE;
+    }
+    return std::to_string(aggregate == "min" ? result.minValue : result.maxValue);
+}
+
+// Close every range cursor a client left open
+void Server::closeRangeCursors(int clientSocket) {
+    std::lock_guard<std::mutex> lock(rangeCursorsMutex);
+    std::erase_if(rangeCursors, [clientSocket](const auto &entry) { return entry.second.clientSocket == clientSocket; });
+}
 
 void Server::handleCommand(std::stringstream& ss, int clientSocket) {
     char op;
@@ -151,10 +375,17 @@ void Server::handleCommand(std::stringstream& ss, int clientSocket) {
     int numToPrintFromEachLevel;
     KEY_t key, start, end;
     VAL_t value;
+    uint64_t sequenceNumber;
+    std::shared_ptr<const TreeVersion> snapshot;
     
-    // Pointers to store the results of get and range
+    // Pointer to store the result of get, and whether a range found any pairs
     std::unique_ptr<VAL_t> valuePtr;
-    std::unique_ptr<std::vector<kvPair>> rangePtr;
+    bool found;
+    // Suffix of a range command, such as the c of rc
+    std::string rangeCommand;
+    // Keys and results of multi-get
+    std::vector<KEY_t> keys;
+    std::vector<std::unique_ptr<VAL_t>> values;
     // fileName is used for load and benchmark operations
     std::string fileName;
 
@@ -214,7 +445,17 @@ void Server::handleCommand(std::stringstream& ss, int clientSocket) {
                 response = printDSLHelp();
                 break;
             }
-            valuePtr = lsmTree->get(key);
+            // An optional sequence number reads the key as of that snapshot
+            if (ss >> sequenceNumber) {
+                snapshot = lsmTree->getSnapshot(sequenceNumber);
+                if (snapshot == nullptr) {
+                    response = "ERROR: No snapshot at sequence number " + std::to_string(sequenceNumber) + "\n";
+                    break;
+                }
+                valuePtr = lsmTree->get(key, *snapshot);
+            } else {
+                valuePtr = lsmTree->get(key);
+            }
             if (valuePtr != nullptr) {
                 response = std::to_string(*valuePtr);
             }
@@ -222,26 +463,81 @@ void Server::handleCommand(std::stringstream& ss, int clientSocket) {
                 response = NO_VALUE;
             }
             break;
+        case 'm':
+            while (ss >> key) {
+                keys.push_back(key);
+            }
+            // Break if there are no keys
+            if (keys.empty()) {
+                response = printDSLHelp();
+                break;
+            }
+            values = lsmTree->multiGet(keys);
+            // Return the found keys as key:value separated by spaces, in the order they were requested
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (values[i] != nullptr) {
+                    response += std::to_string(keys[i]) + ":" + std::to_string(*values[i]) + " ";
+                }
+            }
+            if (response.empty()) {
+                response = NO_VALUE;
+            }
+            break;
         case 'r':
+            // Range commands with a suffix: rc opens a range cursor, rn reads its next batch, rl reads the first pairs of
+            // a range, rv filters a range by value, re estimates the size of a range, and rcount, rsum, rmin and rmax
+            // aggregate a range. release releases a snapshot, as x does. A plain range may have its start key right after
+            // the r, as in "r10 20".
+            if (ss.peek() != EOF && std::isalpha(ss.peek())) {
+                ss >> rangeCommand;
+                if (rangeCommand == "c") {
+                    response = openRangeCursor(ss, clientSocket);
+                } else if (rangeCommand == "n") {
+                    readRangeCursor(ss, clientSocket, response);
+                } else if (rangeCommand == "l") {
+                    limitRange(ss, clientSocket, response);
+                } else if (rangeCommand == "v") {
+                    filterRange(ss, clientSocket, response);
+                } else if (rangeCommand == "e") {
+                    response = estimateRange(ss);
+                } else if (rangeCommand == "elease") {
+                    response = releaseSnapshot(ss);
+                } else if (rangeCommand == "count" || rangeCommand == "sum" || rangeCommand == "min" || rangeCommand == "max") {
+                    response = aggregateRange(rangeCommand, ss);
+                } else {
+                    response = printDSLHelp();
+                }
+                break;
+            }
             ss >> start >> end;
             // Break if start and end are not numbers
             if (ss.fail()) {
                 response = printDSLHelp();
                 break;
             }
-            rangePtr = lsmTree->range(start, end);
-            if (rangePtr->size() > 0) {
-                // Iterate over the vector and store the key-value pairs in results
-                for (const auto &p : *rangePtr) {
-                    // Return key-value pairs as key:value separated by spaces
-                    response += std::to_string(p.key) + ":" + std::to_string(p.value) + " ";
+            // An optional sequence number reads the range as of that snapshot. The pairs are sent as they are merged.
+            if (ss >> sequenceNumber) {
+                snapshot = lsmTree->getSnapshot(sequenceNumber);
+                if (snapshot == nullptr) {
+                    response = "ERROR: No snapshot at sequence number " + std::to_string(sequenceNumber) + "\n";
+                    break;
                 }
+                found = lsmTree->scanRange(start, end, *snapshot, streamPairs(clientSocket, response)) > 0;
+            } else {
+                found = lsmTree->scanRange(start, end, streamPairs(clientSocket, response)) > 0;
             }
-            else {
+            if (!found) {
                 response = NO_VALUE;
             }
             break;
         case 's':
+            // snap takes a snapshot, as n does
+            if (ss.peek() != EOF && std::isalpha(ss.peek())) {
+                std::string statsCommand;
+                ss >> statsCommand;
+                response = (statsCommand == "nap") ? std::to_string(lsmTree->createSnapshot()) : printDSLHelp();
+                break;
+            }
             // Check if there's an integer after the 's' option
             if (ss >> numToPrintFromEachLevel) {
                 // Check if the integer is positive
@@ -260,6 +556,12 @@ void Server::handleCommand(std::stringstream& ss, int clientSocket) {
         case 'i':
             response = lsmTree->printInfo();
             break;
+        case 'n':
+            response = std::to_string(lsmTree->createSnapshot());
+            break;
+        case 'x':
+            response = releaseSnapshot(ss);
+            break;
         default:
             response = printDSLHelp();
         }
@@ -346,21 +648,37 @@ void Server::close() {
 }
 
 void Server::createLSMTree(float bfErrorRate, int bufferNumPages, int fanout, Level::Policy levelPolicy, size_t numThreads, 
-                           float compactionPercentage, std::string dataDirectory, bool throughputPrinting, size_t throughputFrequency) {
+                           float compactionPercentage, std::string dataDirectory, bool throughputPrinting, size_t throughputFrequency,
+                           double filterMemoryBudgetMB, bool optimizeForHits, size_t rowCacheCapacity, bool parallelGets,
+                           size_t learnedIndexEpsilon, bool blockHashIndex, double blockCacheMB, bool partitionedFilters) {
     // Path to data directory and JSON file for serialization
     std::string lsmTreeJsonFile = dataDirectory + "/" + LSM_TREE_JSON_FILE;
     // Create LSM-Tree with lsmTree unique pointer
     lsmTree = std::make_unique<LSMTree>(bfErrorRate, bufferNumPages, fanout, levelPolicy, numThreads, 
-                                        compactionPercentage, dataDirectory, throughputPrinting, throughputFrequency);
+                                        compactionPercentage, dataDirectory, throughputPrinting, throughputFrequency, filterMemoryBudgetMB,
+                                        optimizeForHits, rowCacheCapacity, parallelGets, learnedIndexEpsilon, blockHashIndex,
+                                        blockCacheMB, partitionedFilters);
     lsmTree->deserialize(lsmTreeJsonFile);
+    lsmTree->startBloomFilterTuner();
     printLSMTreeParameters(lsmTree->getBfErrorRate(), lsmTree->getBufferMaxKvPairs(), lsmTree->getFanout(), lsmTree->getLevelPolicy(), lsmTree->getNumThreads(),
-                           lsmTree->getCompactionPercentage(), lsmTree->getDataDirectory(), lsmTree->getThroughputPrinting(), lsmTree->getThroughputFrequency());
+                           lsmTree->getCompactionPercentage(), lsmTree->getDataDirectory(), lsmTree->getThroughputPrinting(), lsmTree->getThroughputFrequency(),
+                           lsmTree->getFilterMemoryBudgetMB(), lsmTree->getOptimizeForHits(), lsmTree->getRowCacheCapacity(),
+                           lsmTree->getParallelGets(), lsmTree->getLearnedIndexEpsilon(), lsmTree->getBlockHashIndex(),
+                           lsmTree->getBlockCacheMB(), lsmTree->getPartitionedFilters());
 }
 
 void printHelp() {
     SyncedCout() << "Usage: ./server [OPTIONS]\n"
               << "Options:\n"
               << "  -e <errorRate>              Bloom filter error rate (default: " << DEFAULT_ERROR_RATE << ")\n"
+              << "  -m <filterMemoryMB>         Total Bloom filter memory budget in MB, 0 for none (default: " << DEFAULT_FILTER_MEMORY_BUDGET_MB << ")\n"
+              << "  -o                          Optimize Bloom filters for hits: no filters on the last level\n"
+              << "  -r <rowCacheEntries>        Row cache capacity in entries, 0 to disable (default: " << DEFAULT_ROW_CACHE_CAPACITY << ")\n"
+              << "  -g                          Read the runs of all levels in parallel for gets\n"
+              << "  -i <epsilon>                Error bound of the learned index of new runs, 0 for fence pointers only (default: " << DEFAULT_LEARNED_INDEX_EPSILON << ")\n"
+              << "  -b                          Write a hash index for every page of new runs for point lookups\n"
+              << "  -k <blockCacheMB>           Block cache capacity in MB for run pages and filter partitions, 0 to disable (default: " << DEFAULT_BLOCK_CACHE_MB << ")\n"
+              << "  -a                          Partition the Bloom filters of new runs per page and read them on demand, requires -k\n"
               << "  -n <numPages>               Size of the buffer by number of disk pages (default: " << DEFAULT_NUM_PAGES << ")\n"
               << "  -f <fanout>                 LSM tree fanout (default: " << DEFAULT_FANOUT << ")\n"
               << "  -l <levelPolicy>            Compaction policy (options are TIERED, LEVELED, LAZY_LEVELED, PARTIAL default: " << Level::policyToString(DEFAULT_LEVELING_POLICY) << ")\n"
@@ -375,11 +693,21 @@ void printHelp() {
 }
 
 void Server::printLSMTreeParameters(float bfErrorRate, size_t bufferMaxKvPairs, int fanout, Level::Policy levelPolicy, size_t numThreads, 
-                                    float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency) {
+                                    float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency,
+                                    double filterMemoryBudgetMB, bool optimizeForHits, size_t rowCacheCapacity, bool parallelGets,
+                                    size_t learnedIndexEpsilon, bool blockHashIndex, double blockCacheMB, bool partitionedFilters) {
     std::string verboseFrequencyString = (verbose) ? " (report every " + addCommas(std::to_string(verboseFrequency)) + " commands)" : "";    
     std::string throughputFrequencyString = (throughputPrinting) ? " (report every " + addCommas(std::to_string(throughputFrequency)) + " commands)" : "";
     SyncedCout() << "LSMTree parameters:" << std::endl;
     SyncedCout() << "  Bloom filter error rate: " << bfErrorRate << std::endl;
+    SyncedCout() << "  Bloom filter memory budget: " << (filterMemoryBudgetMB > 0 ? std::to_string(filterMemoryBudgetMB) + " MB" : "none") << std::endl;
+    SyncedCout() << "  Optimize Bloom filters for hits: " << (optimizeForHits ? "on" : "off") << std::endl;
+    SyncedCout() << "  Row cache capacity: " << (rowCacheCapacity > 0 ? addCommas(std::to_string(rowCacheCapacity)) + " entries" : "off") << std::endl;
+    SyncedCout() << "  Parallel gets: " << (parallelGets ? "on" : "off") << std::endl;
+    SyncedCout() << "  Learned index epsilon: " << (learnedIndexEpsilon > 0 ? addCommas(std::to_string(learnedIndexEpsilon)) : "off") << std::endl;
+    SyncedCout() << "  Block hash index: " << (blockHashIndex ? "on" : "off") << std::endl;
+    SyncedCout() << "  Block cache capacity: " << (blockCacheMB > 0 ? std::to_string(blockCacheMB) + " MB" : "off") << std::endl;
+    SyncedCout() << "  Partitioned Bloom filters: " << (partitionedFilters ? "on" : "off") << std::endl;
     SyncedCout() << "  Max key-value pairs in buffer: " << addCommas(std::to_string(bufferMaxKvPairs)) << " (" << 
                        addCommas(std::to_string(bufferMaxKvPairs * sizeof(kvPair))) << " bytes) " << std::endl;
     SyncedCout() << "  LSM-tree fanout: " << fanout << std::endl;
@@ -401,30 +729,33 @@ std::string Server::printDSLHelp() {
         "1. Put (Insert/Update a key-value pair)\n"
         "   Syntax: p [INT1] [INT2]\n"
         "   Example: p 10 7\n\n"
-        "2. Get (Retrieve the value associated with a key)\n"
-        "   Syntax: g [INT1]\n"
+        "2. Get (Retrieve the value associated with a key, optionally as of a snapshot)\n"
+        "   Syntax: g [INT1] [SNAPSHOT (optional)]\n"
         "   Example: g 10\n\n"
-        "3. Range (Retrieve key-value pairs within a range of keys)\n"
-        "   Syntax: r [INT1] [INT2]\n"
+        "3. Range (Retrieve key-value pairs within a range of keys, optionally as of a snapshot)\n"
+        "   Syntax: r [INT1] [INT2] [SNAPSHOT (optional)]\n"
         "   Example: r 10 12\n\n"
-        "4. Delete (Remove a key-value pair)\n"
+        "4. Multi-get (Retrieve the values of several keys at once)\n"
+        "   Syntax: m [INT1] [INT2] ...\n"
+        "   Example: m 10 12 15\n\n"
+        "5. Delete (Remove a key-value pair)\n"
         "   Syntax: d [INT1]\n"
         "   Example: d 10\n\n"
-        "5. Load (Insert key-value pairs from a binary file)\n"
+        "6. Load (Insert key-value pairs from a binary file)\n"
         "   Syntax: l \"/path/to/fileName\"\n"
         "   Example: l \"~/load_file.bin\"\n\n"
-        "6. Benchmark (Run commands from a text file quietly with no output.)\n"
+        "7. Benchmark (Run commands from a text file quietly with no output.)\n"
         "   NOT MULTIPLE THREAD SAFE since it bypasses the server/client blocking)\n"
         "   Syntax: b \"/path/to/fileName\"\n"
         "   Example: b \"~/workload.txt\"\n\n"
-        "7. Print Stats (Display information about the current state of the tree)\n"
+        "8. Print Stats (Display information about the current state of the tree)\n"
         "   Syntax: s [INT1 (optional number of results returned per level)]\n"
         "   Example: \n"
         "     Logical Pairs: 10\n"
         "     LVL1: 3, LVL3: 9\n"
         "     45:56:L1 56:84:L1 91:45:L1\n"
         "     7:32:L3 19:73:L3 32:91:L3 45:64:L3 58:3:L3 85:15:L3 91:71:L3 95:87:L3 97:76:L3\n\n"
-        "8. Summarized Tree Info\n"
+        "9. Summarized Tree Info\n"
         "   Syntax: i\n"
         "   Example: \n"
         "     Number of logical key-value pairs: 9,988,261\n"
@@ -440,7 +771,32 @@ std::string Server::printDSLHelp() {
         "     Number of key-value pairs in level 2: 7,864,320 (Max 26,214,400, 30\% full)\n"
         "     Level 1 disk type: SSD, disk penalty multiplier: 1, is it the last level? No\n"
         "     Level 2 disk type: HDD1, disk penalty multiplier: 5, is it the last level? Yes\n\n"
-        "9. Shutdown server and save the database state to disk\n"
+        "10. Snapshot (Take a snapshot of the tree and return its sequence number)\n"
+        "   Syntax: snap, or n\n\n"
+        "11. Release (Release a snapshot)\n"
+        "   Syntax: release [SNAPSHOT], or x [SNAPSHOT]\n"
+        "   Example: release 42\n\n"
+        "12. Range Cursor (Open a cursor over a range of keys that returns LIMIT pairs at a time)\n"
+        "   Syntax: rc [INT1] [INT2] [LIMIT]\n"
+        "   Example: rc 10 1000 100\n\n"
+        "13. Range Cursor Next (Retrieve the next pairs of a range cursor, or nothing once it is used up)\n"
+        "   Syntax: rn [CURSOR]\n"
+        "   Example: rn 1\n\n"
+        "14. Range Limit (Retrieve the first LIMIT key-value pairs from a key on, optionally up to an end key)\n"
+        "   Syntax: rl [INT1] [LIMIT] [INT2 (optional)]\n"
+        "   Example: rl 10 100\n\n"
+        "15. Range Value Filter (Retrieve the key-value pairs within a range of keys whose value satisfies a comparison,\n"
+        "   optionally as of a snapshot)\n"
+        "   Syntax: rv [INT1] [INT2] [> | >= | < | <= | =] [VALUE] [SNAPSHOT (optional)]\n"
+        "   Example: rv 10 1000 > 50\n\n"
+        "16. Range Estimate (Estimate the number of key-value pairs within a range of keys and their size in bytes\n"
+        "   without reading the range)\n"
+        "   Syntax: re [INT1] [INT2]\n"
+        "   Example: re 10 1000\n\n"
+        "17. Range Aggregates (Count, sum, minimum or maximum of the values within a range of keys, optionally as of a snapshot)\n"
+        "   Syntax: rcount [INT1] [INT2] [SNAPSHOT (optional)], and likewise rsum, rmin and rmax\n"
+        "   Example: rsum 10 1000\n\n"
+        "18. Shutdown server and save the database state to disk\n"
         "   Syntax: q\n"
         "Refer to the documentation for detailed examples and explanations of each command.\n";
 
@@ -467,13 +823,53 @@ int main(int argc, char **argv) {
     std::string dataDirectory = DEFAULT_DATA_DIRECTORY;
     bool throughputPrinting = DEFAULT_THROUGHPUT_PRINTING;
     size_t throughputFrequency = DEFAULT_THROUGHPUT_FREQUENCY;
+    double filterMemoryBudgetMB = DEFAULT_FILTER_MEMORY_BUDGET_MB;
+    bool optimizeForHits = false;
+    size_t rowCacheCapacity = DEFAULT_ROW_CACHE_CAPACITY;
+    bool parallelGets = false;
+    size_t learnedIndexEpsilon = DEFAULT_LEARNED_INDEX_EPSILON;
+    bool blockHashIndex = false;
+    double blockCacheMB = DEFAULT_BLOCK_CACHE_MB;
+    bool partitionedFilters = false;
 
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "e:n:f:l:p:t:c:d:shv")) != -1) {
+    while ((opt = getopt(argc, argv, "e:m:or:gi:bk:an:f:l:p:t:c:d:shv")) != -1) {
         switch (opt) {
         case 'e':
             bfErrorRate = atof(optarg);
             break;
+        case 'm':
+            filterMemoryBudgetMB = atof(optarg);
+            if (filterMemoryBudgetMB < 0) {
+                std::cerr << "Invalid value for -m option. The filter memory budget cannot be negative." << std::endl;
+                exit(1);
+            }
+            break;
+        case 'o':
+            optimizeForHits = true;
+            break;
+        case 'r':
+            rowCacheCapacity = std::stoull(optarg);
+            break;
+        case 'g':
+            parallelGets = true;
+            break;
+        case 'i':
+            learnedIndexEpsilon = std::stoull(optarg);
+            break;
+        case 'b':
+            blockHashIndex = true;
+            break;
+        case 'k':
+            blockCacheMB = atof(optarg);
+            if (blockCacheMB < 0) {
+                std::cerr << "Invalid value for -k option. The block cache capacity cannot be negative." << std::endl;
+                exit(1);
+            }
+            break;
+        case 'a':
+            partitionedFilters = true;
+            break;
         case 'n':
             bufferNumPages = std::stoull(optarg);
             break;
@@ -545,6 +941,12 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    // Partition probes go through the block cache, so without one every probe of a get would be a read
+    if (partitionedFilters && blockCacheMB == 0) {
+        std::cerr << "Invalid use of -a option. Partitioned Bloom filters need a block cache, set with -k." << std::endl;
+        exit(1);
+    }
+
     // Create server instance with the specified port
     Server server(port, verbose, verboseFrequency);
 
@@ -552,7 +954,9 @@ int main(int argc, char **argv) {
     server_ptr = &server;
 
     // Create LSM-Tree with the parsed options
-    server.createLSMTree(bfErrorRate, bufferNumPages, fanout, levelPolicy, numThreads, compactionPercentage, dataDirectory, throughputPrinting, throughputFrequency);
+    server.createLSMTree(bfErrorRate, bufferNumPages, fanout, levelPolicy, numThreads, compactionPercentage, dataDirectory, throughputPrinting, throughputFrequency,
+                         filterMemoryBudgetMB, optimizeForHits, rowCacheCapacity, parallelGets, learnedIndexEpsilon, blockHashIndex,
+                         blockCacheMB, partitionedFilters);
     // Create a thread for listening to standard input
     std::thread stdInThread(&Server::listenToStdIn, &server);
     server.run();
@@ -2,6 +2,7 @@
 #include <thread>
 #include <netinet/in.h>
 #include <set>
+#include <map>
 #include "lsm_tree.hpp"
 
 void printHelp();
@@ -11,7 +12,9 @@ class Server
 public:
     explicit Server(int port, bool verbose, size_t verboseFrequency);
     void createLSMTree(float bfErrorRate, int bufferNumPages, int fanout, Level::Policy levelPolicy, size_t numThreads,
-                       float compactionPercentage, std::string dataDirectory, bool throughputPrinting, size_t throughputFrequency);
+                       float compactionPercentage, std::string dataDirectory, bool throughputPrinting, size_t throughputFrequency,
+                       double filterMemoryBudgetMB, bool optimizeForHits, size_t rowCacheCapacity, bool parallelGets,
+                       size_t learnedIndexEpsilon, bool blockHashIndex, double blockCacheMB, bool partitionedFilters);
     void run();
     void close();
     void listenToStdIn();
@@ -28,10 +31,32 @@ private:
     bool verbose;
     size_t verboseFrequency;
     void sendResponse(int clientSocket, const std::string &response);
+    bool sendData(int clientSocket, const std::string &data);
+    RangeCallback streamPairs(int clientSocket, std::string &response);
     void printLSMTreeParameters(float bfErrorRate, size_t bufferMaxKvPairs, int fanout, Level::Policy levelPolicy, size_t numThreads,
-                                float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency);
+                                float compactionPercentage, const std::string& dataDirectory, bool throughputPrinting, size_t throughputFrequency,
+                                double filterMemoryBudgetMB, bool optimizeForHits, size_t rowCacheCapacity, bool parallelGets,
+                                size_t learnedIndexEpsilon, bool blockHashIndex, double blockCacheMB, bool partitionedFilters);
 
     std::set<int> connectedClients;
     std::mutex connectedClientsMutex;
+
+    // Range cursors by id. A cursor belongs to the client that opened it and is closed when that client disconnects.
+    struct ClientRangeCursor {
+        std::unique_ptr<RangeCursor> cursor; // Null once the range is used up
+        size_t limit;
+        int clientSocket;
+    };
+    std::map<uint64_t, ClientRangeCursor> rangeCursors;
+    uint64_t nextRangeCursorId = 1;
+    std::mutex rangeCursorsMutex;
+    std::string openRangeCursor(std::stringstream& ss, int clientSocket);
+    void readRangeCursor(std::stringstream& ss, int clientSocket, std::string &response);
+    void closeRangeCursors(int clientSocket);
+    void limitRange(std::stringstream& ss, int clientSocket, std::string &response);
+    void filterRange(std::stringstream& ss, int clientSocket, std::string &response);
+    std::string estimateRange(std::stringstream& ss);
+    std::string aggregateRange(const std::string& aggregate, std::stringstream& ss);
+    std::string releaseSnapshot(std::stringstream& ss);
     std::mutex coutMutex;
 };